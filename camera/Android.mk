@@ -7,7 +7,7 @@ include $(CLEAR_VARS)
 LOCAL_MODULE_TAGS    := optional
 LOCAL_MODULE_PATH    := $(TARGET_OUT_SHARED_LIBRARIES)/hw
 LOCAL_MODULE         := camera.$(TARGET_BOOTLOADER_BOARD_NAME)
-LOCAL_SRC_FILES      := cameraHal.cpp
+LOCAL_SRC_FILES      := cameraHal.cpp PreviewConverter.cpp PreviewWorker.cpp RawFrameTap.cpp
 LOCAL_PRELINK_MODULE := false
 
 LOCAL_SHARED_LIBRARIES += \
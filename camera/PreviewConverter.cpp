@@ -0,0 +1,510 @@
+/*
+ * Copyright (C) 2012, rondoval
+ * Copyright (C) 2012, Won-Kyu Park
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "CameraHAL"
+//#define LOG_NDEBUG 0
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <utils/Log.h>
+
+#if defined(__ARM_NEON__)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "PreviewConverter.h"
+
+namespace android {
+
+/*
+ * Frames are converted in bands of lines. Each band is produced into a small
+ * cached tile, then streamed to the (often write-combined or uncached)
+ * gralloc buffer with wide stores, while the next band's source lines are
+ * being prefetched.
+ */
+static const int kTileBytes  = 16 * 1024;  /* comfortably inside L1 */
+static const int kCacheLine  = 64;
+static const int kBandLines  = 16;         /* untiled band; even, never splits 4:2:0 chroma */
+
+/*
+ * All band converters take the full source frame and write lines
+ * [first, last) starting at rgb, which points at the output of line first.
+ */
+
+//
+// http://code.google.com/p/android/issues/detail?id=823#c4
+//
+static void Yuv420spToRgba8888Full(char* rgb, char* yuv420sp, int width, int height,
+                                   int first, int last) {
+    int frameSize = width * height;
+    int colr = 0;
+    for (int j = first, yp = first * width, k = 0; j < last; j++) {
+        int uvp = frameSize + (j >> 1) * width, u = 0, v = 0;
+        for (int i = 0; i < width; i++, yp++) {
+            int y = (0xff & ((int) yuv420sp[yp])) - 16;
+            if (y < 0) y = 0;
+            if ((i & 1) == 0) {
+                v = (0xff & yuv420sp[uvp++]) - 128;
+                u = (0xff & yuv420sp[uvp++]) - 128;
+            }
+
+            int y1192 = 1192 * y;
+            int r = (y1192 + 1634 * v);
+            int g = (y1192 - 833 * v - 400 * u);
+            int b = (y1192 + 2066 * u);
+
+            if (r < 0) r = 0; else if (r > 262143) r = 262143;
+            if (g < 0) g = 0; else if (g > 262143) g = 262143;
+            if (b < 0) b = 0; else if (b > 262143) b = 262143;
+
+            /* for RGB8888 */
+            r = (r >> 10) & 0xff;
+            g = (g >> 10) & 0xff;
+            b = (b >> 10) & 0xff;
+
+            rgb[k++] = r;
+            rgb[k++] = g;
+            rgb[k++] = b;
+            rgb[k++] = 255;
+        }
+    }
+}
+
+static void Yuv422iToRgba8888Full(char* rgb, char* yuv422i, int width, int height,
+                                  int first, int last) {
+    int yuv_index = first * width * 2;
+    int rgb_index = 0;
+
+    for (int i = first * width / 2; i < last * width / 2; i++) {
+
+            int y1 = (0xff & ((int) yuv422i[yuv_index++])) - 16;
+            if (y1 < 0) y1 = 0;
+
+            int u = (0xff & yuv422i[yuv_index++]) - 128;
+
+            int y2 = (0xff & ((int) yuv422i[yuv_index++])) - 16;
+            if (y2 < 0) y2 = 0;
+
+            int v = (0xff & yuv422i[yuv_index++]) - 128;
+
+            int y1192 = 1192 * y1;
+            int r = (y1192 + 1634 * v);
+            int g = (y1192 - 833 * v - 400 * u);
+            int b = (y1192 + 2066 * u);
+
+            if (r < 0) r = 0; else if (r > 262143) r = 262143;
+            if (g < 0) g = 0; else if (g > 262143) g = 262143;
+            if (b < 0) b = 0; else if (b > 262143) b = 262143;
+
+            /* for RGB8888 */
+            r = (r >> 10) & 0xff;
+            g = (g >> 10) & 0xff;
+            b = (b >> 10) & 0xff;
+
+            rgb[rgb_index++] = r;
+            rgb[rgb_index++] = g;
+            rgb[rgb_index++] = b;
+            rgb[rgb_index++] = 255;
+
+            y1192 = 1192 * y2;
+            r = (y1192 + 1634 * v);
+            g = (y1192 - 833 * v - 400 * u);
+            b = (y1192 + 2066 * u);
+
+            if (r < 0) r = 0; else if (r > 262143) r = 262143;
+            if (g < 0) g = 0; else if (g > 262143) g = 262143;
+            if (b < 0) b = 0; else if (b > 262143) b = 262143;
+
+            /* for RGB8888 */
+            r = (r >> 10) & 0xff;
+            g = (g >> 10) & 0xff;
+            b = (b >> 10) & 0xff;
+
+            rgb[rgb_index++] = r;
+            rgb[rgb_index++] = g;
+            rgb[rgb_index++] = b;
+            rgb[rgb_index++] = 255;
+    }
+}
+
+/*
+ * Cheaper tiers. These write whole RGBA pixels (R in the lowest byte) instead
+ * of single bytes, so the destination has to be 32 bit aligned, which gralloc
+ * buffers always are.
+ */
+struct ChromaTerms {
+    int r;
+    int g;
+    int b;
+};
+
+static inline uint32_t packRgba(int r, int g, int b) {
+    return (uint32_t)r | ((uint32_t)g << 8) | ((uint32_t)b << 16) | 0xff000000;
+}
+
+static inline int clamp8(int x) {
+    return x < 0 ? 0 : (x > 255 ? 255 : x);
+}
+
+template <bool fast>
+static inline void chromaTerms(int u, int v, ChromaTerms *c) {
+    if (fast) {
+        c->r = 409 * v;
+        c->g = -208 * v - 100 * u;
+        c->b = 516 * u;
+    } else {
+        c->r = 1634 * v;
+        c->g = -833 * v - 400 * u;
+        c->b = 2066 * u;
+    }
+}
+
+template <bool fast>
+static inline uint32_t pixel(int y, const ChromaTerms &c) {
+    if (fast) {
+        // No black level clamp: the final clamp takes care of it
+        int y298 = 298 * (y - 16) + 128;
+        return packRgba(clamp8((y298 + c.r) >> 8), clamp8((y298 + c.g) >> 8),
+                        clamp8((y298 + c.b) >> 8));
+    }
+
+    y -= 16;
+    if (y < 0) y = 0;
+    int y1192 = 1192 * y;
+    int r = y1192 + c.r;
+    int g = y1192 + c.g;
+    int b = y1192 + c.b;
+
+    if (r < 0) r = 0; else if (r > 262143) r = 262143;
+    if (g < 0) g = 0; else if (g > 262143) g = 262143;
+    if (b < 0) b = 0; else if (b > 262143) b = 262143;
+
+    return packRgba(r >> 10, g >> 10, b >> 10);
+}
+
+/* Two lines at a time, so each VU pair is evaluated once for its 2x2 block */
+template <bool fast>
+static void Yuv420spBlocks(uint32_t *rgb, const uint8_t *yuv, int width, int height,
+                           int first, int last) {
+    const uint8_t *uvPlane = yuv + width * height;
+    ChromaTerms c;
+
+    for (int j = first; j < last; j += 2) {
+        const uint8_t *y0 = yuv + j * width;
+        const uint8_t *y1 = y0 + width;
+        const uint8_t *uv = uvPlane + (j >> 1) * width;
+        uint32_t *out0 = rgb + (j - first) * width;
+        uint32_t *out1 = out0 + width;
+        bool lastLine = (j + 1 >= last);
+
+        for (int i = 0; i < width; i += 2) {
+            chromaTerms<fast>(uv[i + 1] - 128, uv[i] - 128, &c);
+            out0[i]     = pixel<fast>(y0[i], c);
+            out0[i + 1] = pixel<fast>(y0[i + 1], c);
+            if (!lastLine) {
+                out1[i]     = pixel<fast>(y1[i], c);
+                out1[i + 1] = pixel<fast>(y1[i + 1], c);
+            }
+        }
+    }
+}
+
+static void Yuv420spHalf(uint32_t *rgb, const uint8_t *yuv, int width, int height,
+                         int first, int last) {
+    const uint8_t *uvPlane = yuv + width * height;
+    ChromaTerms c;
+
+    for (int j = first; j < last; j += 2) {
+        const uint8_t *y0 = yuv + j * width;
+        const uint8_t *uv = uvPlane + (j >> 1) * width;
+        uint32_t *out0 = rgb + (j - first) * width;
+        uint32_t *out1 = out0 + width;
+        bool lastLine = (j + 1 >= last);
+
+        for (int i = 0; i < width; i += 2) {
+            chromaTerms<true>(uv[i + 1] - 128, uv[i] - 128, &c);
+            uint32_t p = pixel<true>(y0[i], c);
+            out0[i] = out0[i + 1] = p;
+            if (!lastLine) {
+                out1[i] = out1[i + 1] = p;
+            }
+        }
+    }
+}
+
+template <bool fast>
+static void Yuv422iPairs(uint32_t *rgb, const uint8_t *yuv, int width, int height,
+                         int first, int last) {
+    int pairs = (last - first) * width / 2;
+    ChromaTerms c;
+
+    yuv += first * width * 2;
+    for (int i = 0; i < pairs; i++, yuv += 4, rgb += 2) {
+        chromaTerms<fast>(yuv[1] - 128, yuv[3] - 128, &c);
+        rgb[0] = pixel<fast>(yuv[0], c);
+        rgb[1] = pixel<fast>(yuv[2], c);
+    }
+}
+
+static void Yuv422iHalf(uint32_t *rgb, const uint8_t *yuv, int width, int height,
+                        int first, int last) {
+    ChromaTerms c;
+
+    for (int j = first; j < last; j += 2) {
+        const uint8_t *in = yuv + j * width * 2;
+        uint32_t *out0 = rgb + (j - first) * width;
+        uint32_t *out1 = out0 + width;
+        bool lastLine = (j + 1 >= last);
+
+        for (int i = 0; i < width; i += 2, in += 4) {
+            chromaTerms<true>(in[1] - 128, in[3] - 128, &c);
+            uint32_t p = pixel<true>(in[0], c);
+            out0[i] = out0[i + 1] = p;
+            if (!lastLine) {
+                out1[i] = out1[i + 1] = p;
+            }
+        }
+    }
+}
+
+/*
+ * Luma statistics are gathered band by band, right after the band has been
+ * converted and its source lines are still in the cache. Every other pixel of
+ * every other line is sampled, which is plenty for a histogram and a mean.
+ * Sharpness is the summed absolute difference between a sample and its
+ * sampled neighbour on the right.
+ */
+static void accumulateLuma(LumaStats *stats, const uint8_t *y, int width, int lines,
+                           int pitch, int step) {
+    for (int j = 0; j < lines; j += 2, y += 2 * pitch) {
+        int prev = y[0];
+        for (int i = 0; i < width; i += 2) {
+            int luma = y[i * step];
+            int diff = luma - prev;
+            stats->histogram[luma >> LUMA_HISTOGRAM_SHIFT]++;
+            stats->sum += luma;
+            stats->gradient += diff < 0 ? -diff : diff;
+            prev = luma;
+        }
+        stats->samples += (width + 1) / 2;
+    }
+}
+
+typedef void (*band_fn)(uint32_t *rgb, const uint8_t *yuv, int width, int height,
+                        int first, int last);
+
+static void Yuv420spFullBand(uint32_t *rgb, const uint8_t *yuv, int width, int height,
+                             int first, int last) {
+    Yuv420spToRgba8888Full((char *)rgb, (char *)yuv, width, height, first, last);
+}
+
+static void Yuv422iFullBand(uint32_t *rgb, const uint8_t *yuv, int width, int height,
+                            int first, int last) {
+    Yuv422iToRgba8888Full((char *)rgb, (char *)yuv, width, height, first, last);
+}
+
+static band_fn yuv420spBand(int tier) {
+    switch (tier) {
+        case PREVIEW_TIER_SHARED_CHROMA: return Yuv420spBlocks<false>;
+        case PREVIEW_TIER_FAST:          return Yuv420spBlocks<true>;
+        case PREVIEW_TIER_HALF:          return Yuv420spHalf;
+        default:                         return Yuv420spFullBand;
+    }
+}
+
+static band_fn yuv422iBand(int tier) {
+    switch (tier) {
+        case PREVIEW_TIER_SHARED_CHROMA: return Yuv422iPairs<false>;
+        case PREVIEW_TIER_FAST:          return Yuv422iPairs<true>;
+        case PREVIEW_TIER_HALF:          return Yuv422iHalf;
+        default:                         return Yuv422iFullBand;
+    }
+}
+
+static inline void prefetchLines(const uint8_t *src, int bytes) {
+    for (int i = 0; i < bytes; i += kCacheLine) {
+        __builtin_prefetch(src + i, 0, 0);
+    }
+}
+
+/*
+ * Copy a finished tile to the destination with the widest stores available:
+ * 64 byte NEON bursts on ARM (there is no non-temporal store on ARMv7, but
+ * full bursts drain the write buffer best), streaming stores elsewhere.
+ */
+static void streamTile(char *dst, const uint32_t *tile, int bytes) {
+    const uint8_t *src = (const uint8_t *)tile;
+#if defined(__ARM_NEON__)
+    uint8_t *out = (uint8_t *)dst;
+    for (; bytes >= 64; bytes -= 64, src += 64, out += 64) {
+        uint8x16_t a = vld1q_u8(src);
+        uint8x16_t b = vld1q_u8(src + 16);
+        uint8x16_t c = vld1q_u8(src + 32);
+        uint8x16_t d = vld1q_u8(src + 48);
+        vst1q_u8(out, a);
+        vst1q_u8(out + 16, b);
+        vst1q_u8(out + 32, c);
+        vst1q_u8(out + 48, d);
+    }
+    memcpy(out, src, bytes);
+#elif defined(__SSE2__)
+    char *out = dst;
+    if (((uintptr_t)out & 15) == 0) {
+        for (; bytes >= 64; bytes -= 64, src += 64, out += 64) {
+            __m128i a = _mm_load_si128((const __m128i *)src);
+            __m128i b = _mm_load_si128((const __m128i *)(src + 16));
+            __m128i c = _mm_load_si128((const __m128i *)(src + 32));
+            __m128i d = _mm_load_si128((const __m128i *)(src + 48));
+            _mm_stream_si128((__m128i *)out, a);
+            _mm_stream_si128((__m128i *)(out + 16), b);
+            _mm_stream_si128((__m128i *)(out + 32), c);
+            _mm_stream_si128((__m128i *)(out + 48), d);
+        }
+        _mm_sfence();
+    }
+    memcpy(out, src, bytes);
+#else
+    memcpy(dst, src, bytes);
+#endif
+}
+
+/*
+ * Drive a band converter over the whole frame. pitch is the number of bytes
+ * per source luma line and step the distance between luma samples; chroma
+ * is the 4:2:0 chroma plane, or NULL if chroma is interleaved with luma.
+ */
+static void convertFrame(band_fn convert, char *rgb, const uint8_t *yuv, const uint8_t *chroma,
+                         int width, int height, int pitch, int step, int flags,
+                         LumaStats *stats) {
+    uint32_t tile[kTileBytes / sizeof(uint32_t)] __attribute__((aligned(16)));
+    int lineBytes = width * 4;
+    bool tiled = (flags & PREVIEW_CONVERT_TILED) && lineBytes * 2 <= kTileBytes;
+    int band = tiled ? (kTileBytes / lineBytes) & ~1 : kBandLines;
+
+    for (int first = 0; first < height; first += band) {
+        int last = first + band < height ? first + band : height;
+        int next = last + band < height ? last + band : height;
+
+        prefetchLines(yuv + last * pitch, (next - last) * pitch);
+        if (chroma != NULL) {
+            prefetchLines(chroma + (last >> 1) * width, ((next - last) >> 1) * width);
+        }
+
+        if (tiled) {
+            convert(tile, yuv, width, height, first, last);
+            streamTile(rgb + first * lineBytes, tile, (last - first) * lineBytes);
+        } else {
+            convert((uint32_t *)(rgb + first * lineBytes), yuv, width, height, first, last);
+        }
+
+        if (stats != NULL) {
+            accumulateLuma(stats, yuv + first * pitch, width, last - first, pitch, step);
+        }
+    }
+}
+
+void Yuv420spToRgba8888(char* rgb, char* yuv420sp, int width, int height, int tier,
+                        int flags, LumaStats *stats) {
+    const uint8_t *in = (const uint8_t *)yuv420sp;
+    convertFrame(yuv420spBand(tier), rgb, in, in + width * height, width, height,
+                 width, 1, flags, stats);
+}
+
+void Yuv422iToRgba8888(char* rgb, char* yuv422i, int width, int height, int tier,
+                       int flags, LumaStats *stats) {
+    convertFrame(yuv422iBand(tier), rgb, (const uint8_t *)yuv422i, NULL, width, height,
+                 width * 2, 2, flags, stats);
+}
+
+nsecs_t benchmarkConversion(char *dst, int width, int height, bool yuv422i, int tier,
+                            int flags, int iterations) {
+    size_t size = width * height * 2;
+    char *frame = (char *)malloc(size);
+    if (frame == NULL) {
+        return -1;
+    }
+    // Something that exercises the clamps, not just flat grey
+    for (size_t i = 0; i < size; i++) {
+        frame[i] = (char)((i * 2654435761u) >> 24);
+    }
+
+    nsecs_t start = systemTime();
+    for (int i = 0; i < iterations; i++) {
+        if (yuv422i) {
+            Yuv422iToRgba8888(dst, frame, width, height, tier, flags, NULL);
+        } else {
+            Yuv420spToRgba8888(dst, frame, width, height, tier, flags, NULL);
+        }
+    }
+    nsecs_t elapsed = systemTime() - start;
+
+    free(frame);
+    return elapsed / iterations;
+}
+
+void finishLumaStats(const LumaStats *stats, camera_luma_stats_t *out) {
+    memcpy(out->histogram, stats->histogram, sizeof(out->histogram));
+    out->samples = stats->samples;
+    out->mean = stats->samples ? (uint32_t)(stats->sum / stats->samples) : 0;
+    // Average neighbour difference in 1/16 luma steps
+    out->sharpness = stats->samples ? (uint32_t)(stats->gradient * 16 / stats->samples) : 0;
+}
+
+void PreviewGovernor::init(int fixedTier) {
+    if (fixedTier >= PREVIEW_TIER_COUNT) {
+        fixedTier = PREVIEW_TIER_COUNT - 1;
+    }
+    mFixedTier = fixedTier;
+    mTier = fixedTier < 0 ? PREVIEW_TIER_FULL : fixedTier;
+    mAvgProcess = 0;
+    mOverBudget = 0;
+    mUnderBudget = 0;
+}
+
+void PreviewGovernor::update(nsecs_t processTime, nsecs_t frameInterval) {
+    mAvgProcess = mAvgProcess ? (mAvgProcess * 7 + processTime) / 8 : processTime;
+
+    if (mFixedTier >= 0 || frameInterval <= 0) {
+        return;
+    }
+
+    if (mAvgProcess > frameInterval * 9 / 10) {
+        mUnderBudget = 0;
+        if (++mOverBudget >= kStepDownFrames && mTier < PREVIEW_TIER_COUNT - 1) {
+            mTier++;
+            mOverBudget = 0;
+            LOGI("%s: preview takes %lld us per %lld us frame, stepping down to tier %d",
+                 __FUNCTION__, ns2us(mAvgProcess), ns2us(frameInterval), mTier);
+        }
+    } else if (mAvgProcess < frameInterval / 2) {
+        mOverBudget = 0;
+        if (++mUnderBudget >= kStepUpFrames && mTier > PREVIEW_TIER_FULL) {
+            mTier--;
+            mUnderBudget = 0;
+            LOGI("%s: preview takes %lld us per %lld us frame, stepping up to tier %d",
+                 __FUNCTION__, ns2us(mAvgProcess), ns2us(frameInterval), mTier);
+        }
+    } else {
+        mOverBudget = 0;
+        mUnderBudget = 0;
+    }
+}
+
+}; // namespace android
@@ -0,0 +1,123 @@
+/*
+ * Copyright (C) 2012, rondoval
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_HARDWARE_CAMERA_PREVIEW_CONVERTER_H
+#define ANDROID_HARDWARE_CAMERA_PREVIEW_CONVERTER_H
+
+#include <stdint.h>
+#include <utils/Timers.h>
+
+namespace android {
+
+/**
+ * Software preview conversion tiers, from best looking to cheapest.
+ */
+enum PreviewTier {
+    /* Original converters, 10 bit fixed point, one chroma evaluation per pixel */
+    PREVIEW_TIER_FULL = 0,
+    /* Chroma terms evaluated once per chroma sample and shared by its pixels */
+    PREVIEW_TIER_SHARED_CHROMA,
+    /* As above, 8 bit fixed point matrix and no clamping of y < 0 */
+    PREVIEW_TIER_FAST,
+    /* Fast matrix on every other pixel and line, each result written 2x2 */
+    PREVIEW_TIER_HALF,
+    PREVIEW_TIER_COUNT
+};
+
+#define LUMA_HISTOGRAM_BINS     64
+#define LUMA_HISTOGRAM_SHIFT    2       /* 256 luma levels >> 2 */
+
+/**
+ * Payload of the private CAMERA_MSG_SHIM_LUMA_STATS data callback, sent
+ * once per converted preview frame.
+ */
+typedef struct camera_luma_stats {
+    uint32_t version;       /* CAMERA_LUMA_STATS_VERSION */
+    uint32_t width;
+    uint32_t height;
+    uint32_t samples;       /* luma samples that went into the histogram */
+    uint32_t mean;          /* 0..255 */
+    uint32_t sharpness;     /* mean horizontal luma difference, in 1/16 steps */
+    uint32_t histogram[LUMA_HISTOGRAM_BINS];
+} camera_luma_stats_t;
+
+#define CAMERA_LUMA_STATS_VERSION 1
+
+/** Accumulators filled in while a frame is converted; zero before use. */
+struct LumaStats {
+    uint32_t histogram[LUMA_HISTOGRAM_BINS];
+    uint32_t samples;
+    uint64_t sum;
+    uint64_t gradient;
+};
+
+/* Conversion flags */
+enum {
+    /* Build output in a cached tile and stream it out with wide stores */
+    PREVIEW_CONVERT_TILED = 0x1,
+};
+
+/* stats may be NULL; when it isn't, luma statistics are gathered on the fly */
+void Yuv420spToRgba8888(char* rgb, char* yuv420sp, int width, int height, int tier,
+                        int flags, LumaStats *stats);
+void Yuv422iToRgba8888(char* rgb, char* yuv422i, int width, int height, int tier,
+                       int flags, LumaStats *stats);
+
+/**
+ * Average time to convert a synthetic frame into dst, which must hold
+ * width * height RGBA pixels. Meant to compare destination mappings (cached
+ * heap vs. gralloc) and flags on a device. Returns -1 on allocation failure.
+ */
+nsecs_t benchmarkConversion(char *dst, int width, int height, bool yuv422i, int tier,
+                            int flags, int iterations);
+
+/** Fill in mean, sharpness, samples and histogram of the callback payload */
+void finishLumaStats(const LumaStats *stats, camera_luma_stats_t *out);
+
+/**
+ * Picks the conversion tier of one camera device. It steps down a tier when
+ * the smoothed frame processing time stays above the frame interval, and
+ * back up once it has stayed well below it for a while.
+ *
+ * Lives in the calloc'ed legacy_camera_device, so it has no constructor;
+ * call init() before use. Only touched from the preview worker.
+ */
+class PreviewGovernor {
+public:
+    /** fixedTier < 0 lets the governor choose, anything else pins the tier */
+    void init(int fixedTier);
+    void update(nsecs_t processTime, nsecs_t frameInterval);
+
+    int tier() const { return mTier; }
+    bool automatic() const { return mFixedTier < 0; }
+    nsecs_t averageProcessTime() const { return mAvgProcess; }
+
+private:
+    enum {
+        kStepDownFrames = 8,    /* consecutive frames over budget */
+        kStepUpFrames   = 60,   /* consecutive frames well under budget */
+    };
+
+    int     mFixedTier;
+    int     mTier;
+    nsecs_t mAvgProcess;
+    int     mOverBudget;
+    int     mUnderBudget;
+};
+
+}; // namespace android
+
+#endif
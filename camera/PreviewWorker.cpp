@@ -0,0 +1,166 @@
+/*
+ * Copyright (C) 2012, rondoval
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "CameraHAL"
+//#define LOG_NDEBUG 0
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <cutils/atomic.h>
+#include <utils/Log.h>
+
+#include "PreviewWorker.h"
+
+namespace android {
+
+PreviewWorker::PreviewWorker(int cameraId, render_fn render, void *cookie)
+    : Thread(false),
+      mCameraId(cameraId),
+      mRender(render),
+      mCookie(cookie),
+      mBack(0),
+      mFront(1),
+      mMailbox(2),
+      mLastPost(0),
+      mFrameInterval(0),
+      mFrameIntervalUs(0)
+{
+    memset(mBuffers, 0, sizeof(mBuffers));
+    memset(&mStats, 0, sizeof(mStats));
+    sem_init(&mWakeup, 0, 0);
+}
+
+PreviewWorker::~PreviewWorker()
+{
+    for (int i = 0; i < kNumBuffers; i++) {
+        free(mBuffers[i].data);
+    }
+    sem_destroy(&mWakeup);
+}
+
+status_t PreviewWorker::readyToRun()
+{
+    LOGV("%s: preview worker for camera %d running", __FUNCTION__, mCameraId);
+    return NO_ERROR;
+}
+
+void PreviewWorker::post(const char *frame, size_t size)
+{
+    Buffer *buf = &mBuffers[mBack];
+    nsecs_t now = systemTime();
+
+    if (mLastPost) {
+        nsecs_t interval = now - mLastPost;
+        mFrameInterval = mFrameInterval ? (mFrameInterval * 7 + interval) / 8 : interval;
+        nsecs_t intervalUs = ns2us(mFrameInterval);
+        android_atomic_release_store(intervalUs < INT32_MAX ? intervalUs : INT32_MAX,
+                                     &mFrameIntervalUs);
+    }
+    mLastPost = now;
+
+    if (buf->capacity < size) {
+        char *data = (char *)realloc(buf->data, size);
+        if (data == NULL) {
+            LOGE("%s: could not grow preview buffer to %d bytes", __FUNCTION__, size);
+            return;
+        }
+        buf->data = data;
+        buf->capacity = size;
+    }
+    memcpy(buf->data, frame, size);
+    buf->size = size;
+    mStats.framesPosted++;
+
+    int32_t old;
+    do {
+        old = mMailbox;
+    } while (android_atomic_release_cas(old, mBack | kPending, &mMailbox));
+    mBack = old & kIndexMask;
+
+    if (old & kPending) {
+        // The worker never saw the previous frame; it already has a wakeup queued.
+        mStats.framesDropped++;
+    } else {
+        sem_post(&mWakeup);
+    }
+}
+
+void PreviewWorker::flush()
+{
+    int32_t old;
+    do {
+        old = android_atomic_acquire_load(&mMailbox);
+    } while ((old & kPending) &&
+             android_atomic_acquire_cas(old, old & kIndexMask, &mMailbox));
+}
+
+void PreviewWorker::stop()
+{
+    requestExit();
+    sem_post(&mWakeup);
+    requestExitAndWait();
+}
+
+bool PreviewWorker::threadLoop()
+{
+    sem_wait(&mWakeup);
+    if (exitPending()) {
+        return false;
+    }
+
+    int32_t old;
+    do {
+        old = android_atomic_acquire_load(&mMailbox);
+        if (!(old & kPending)) {
+            // Flushed while we were asleep.
+            return true;
+        }
+    } while (android_atomic_acquire_cas(old, mFront, &mMailbox));
+    mFront = old & kIndexMask;
+
+    Buffer *buf = &mBuffers[mFront];
+    nsecs_t start = systemTime();
+    {
+        Mutex::Autolock lock(mRenderLock);
+        mRender(buf->data, buf->size, mCookie);
+    }
+    nsecs_t elapsed = systemTime() - start;
+
+    mStats.framesRendered++;
+    mStats.renderTimeTotal += elapsed;
+    if (elapsed > mStats.renderTimeMax) {
+        mStats.renderTimeMax = elapsed;
+    }
+    return true;
+}
+
+void PreviewWorker::dump(int fd) const
+{
+    char buffer[256];
+    PreviewStats stats = mStats;
+    nsecs_t avg = stats.framesRendered ? stats.renderTimeTotal / stats.framesRendered : 0;
+
+    snprintf(buffer, sizeof(buffer),
+             "Camera %d preview worker: posted %u rendered %u dropped %u, "
+             "render avg %lld us max %lld us\n",
+             mCameraId, stats.framesPosted, stats.framesRendered, stats.framesDropped,
+             ns2us(avg), ns2us(stats.renderTimeMax));
+    write(fd, buffer, strlen(buffer));
+}
+
+}; // namespace android
@@ -0,0 +1,115 @@
+/*
+ * Copyright (C) 2012, rondoval
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_HARDWARE_CAMERA_PREVIEW_WORKER_H
+#define ANDROID_HARDWARE_CAMERA_PREVIEW_WORKER_H
+
+#include <semaphore.h>
+#include <cutils/atomic.h>
+#include <utils/threads.h>
+#include <utils/Timers.h>
+
+namespace android {
+
+/**
+ * Per-device preview statistics. Each counter has a single writer (the
+ * legacy callback thread or the worker), readers only ever see a slightly
+ * stale snapshot.
+ */
+struct PreviewStats {
+    uint32_t framesPosted;      /* frames handed over by the legacy driver */
+    uint32_t framesRendered;    /* frames that made it to the window */
+    uint32_t framesDropped;     /* frames replaced by a newer one before rendering */
+    nsecs_t  renderTimeTotal;
+    nsecs_t  renderTimeMax;
+};
+
+/**
+ * Renders preview frames of one camera device on its own thread.
+ *
+ * The legacy callback thread copies each frame into a private triple buffer
+ * and publishes it with a single atomic exchange, so it never waits for the
+ * gralloc lock/convert/enqueue cycle. If the worker falls behind, the older
+ * pending frame is replaced by the newer one and counted as dropped. Each
+ * opened camera owns one worker, so a slow window on one device cannot stall
+ * the other.
+ */
+class PreviewWorker : public Thread {
+public:
+    typedef void (*render_fn)(char *frame, size_t size, void *cookie);
+
+    PreviewWorker(int cameraId, render_fn render, void *cookie);
+    virtual ~PreviewWorker();
+
+    /** Copy a frame into the pool and hand it to the worker. Producer side only. */
+    void post(const char *frame, size_t size);
+
+    /** Drop a pending frame, e.g. when preview stops. */
+    void flush();
+
+    /** Wake the worker and wait for it to exit. */
+    void stop();
+
+    /**
+     * Held by the worker while a frame is being rendered. Take it before
+     * changing anything the render function reads (window, geometry...).
+     */
+    Mutex& renderLock() { return mRenderLock; }
+
+    void getStats(PreviewStats *stats) const { *stats = mStats; }
+
+    /** Smoothed time between posted frames, 0 until two frames were seen. Any thread. */
+    nsecs_t frameInterval() const {
+        return us2ns(android_atomic_acquire_load(&mFrameIntervalUs));
+    }
+    void dump(int fd) const;
+
+private:
+    enum {
+        kNumBuffers = 3,
+        kIndexMask  = 0x3,
+        kPending    = 0x4,
+    };
+
+    struct Buffer {
+        char   *data;
+        size_t  size;
+        size_t  capacity;
+    };
+
+    virtual status_t readyToRun();
+    virtual bool     threadLoop();
+
+    int                mCameraId;
+    render_fn          mRender;
+    void              *mCookie;
+
+    Buffer             mBuffers[kNumBuffers];
+    int                mBack;       /* owned by the producer */
+    int                mFront;      /* owned by the worker */
+    volatile int32_t   mMailbox;    /* shared index | kPending */
+    nsecs_t            mLastPost;
+    nsecs_t            mFrameInterval;      /* owned by the producer */
+    volatile int32_t   mFrameIntervalUs;    /* published copy, 32 bits so it cannot tear */
+    sem_t              mWakeup;
+
+    Mutex              mRenderLock;
+    PreviewStats       mStats;
+};
+
+}; // namespace android
+
+#endif
@@ -0,0 +1,216 @@
+/*
+ * Copyright (C) 2012, rondoval
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "CameraHAL"
+//#define LOG_NDEBUG 0
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <cutils/atomic.h>
+#include <cutils/atomic-inline.h>
+#include <utils/Log.h>
+
+#include "RawFrameTap.h"
+
+namespace android {
+
+RawFrameTap::RawFrameTap(int cameraId)
+    : mCameraId(cameraId),
+      mFd(-1),
+      mActive(0),
+      mBusy(0),
+      mRing(NULL),
+      mSlotSize(0),
+      mSlots(0),
+      mHead(0),
+      mTail(0)
+{
+    sem_init(&mQueued, 0, 0);
+}
+
+RawFrameTap::~RawFrameTap()
+{
+    disable();
+    sem_destroy(&mQueued);
+}
+
+status_t RawFrameTap::enable(const char *dir, size_t frameSize, int width, int height, int format,
+                             int interval, int maxFrames, int slots)
+{
+    disable();
+
+    Mutex::Autolock lock(mLock);
+    if (interval < 1 || slots < 1 || frameSize == 0) {
+        return BAD_VALUE;
+    }
+
+    mSlotSize = (sizeof(RawFrameHeader) + frameSize + 3) & ~3;
+    mSlots = slots;
+    mRing = (char *)malloc(mSlotSize * mSlots);
+    if (mRing == NULL) {
+        LOGE("%s: could not allocate %d x %d bytes for the frame tap", __FUNCTION__,
+             mSlots, mSlotSize);
+        return NO_MEMORY;
+    }
+
+    char path[256];
+    snprintf(path, sizeof(path), "%s/camera%d-%ld.raw", dir, mCameraId, (long)time(NULL));
+    mFd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (mFd < 0) {
+        LOGE("%s: could not open %s: %s", __FUNCTION__, path, strerror(errno));
+        releaseRing();
+        return UNKNOWN_ERROR;
+    }
+
+    mWidth = width;
+    mHeight = height;
+    mFormat = format;
+    mInterval = interval;
+    mMaxFrames = maxFrames;
+    mSeen = mCaptured = mDropped = mWritten = mWriteErrors = 0;
+    mHead = mTail = 0;
+    sem_destroy(&mQueued);
+    sem_init(&mQueued, 0, 0);
+
+    char name[32];
+    snprintf(name, sizeof(name), "CameraHAL-tap-%d", mCameraId);
+    mWriter = new Writer(this);
+    if (mWriter->run(name, PRIORITY_BACKGROUND) != NO_ERROR) {
+        LOGE("%s: could not start the frame tap writer", __FUNCTION__);
+        mWriter.clear();
+        close(mFd);
+        mFd = -1;
+        releaseRing();
+        return UNKNOWN_ERROR;
+    }
+
+    LOGI("%s: camera %d: saving every %d. frame to %s", __FUNCTION__, mCameraId, interval, path);
+    android_atomic_release_store(1, &mActive);
+    return NO_ERROR;
+}
+
+void RawFrameTap::disable()
+{
+    Mutex::Autolock lock(mLock);
+    if (mWriter == NULL) {
+        return;
+    }
+
+    /*
+     * Dekker style handshake with capture(): the store to mActive must be
+     * visible before mBusy is read, which a release store alone does not
+     * guarantee, or a capture that already saw mActive set could still be
+     * writing into the ring freed below
+     */
+    android_atomic_release_store(0, &mActive);
+    android_memory_barrier();
+    while (android_atomic_acquire_load(&mBusy)) {
+        usleep(1000);
+    }
+
+    // Everything the producer queued is published now; the writer drains it before exiting
+    mWriter->requestExit();
+    sem_post(&mQueued);
+    mWriter->requestExitAndWait();
+    mWriter.clear();
+
+    close(mFd);
+    mFd = -1;
+    releaseRing();
+
+    LOGI("%s: camera %d: captured %u, written %u, dropped %u, write errors %u", __FUNCTION__,
+         mCameraId, mCaptured, mWritten, mDropped, mWriteErrors);
+}
+
+void RawFrameTap::releaseRing()
+{
+    free(mRing);
+    mRing = NULL;
+    mSlots = 0;
+    mSlotSize = 0;
+}
+
+void RawFrameTap::capture(const char *frame, size_t size)
+{
+    if (!android_atomic_acquire_load(&mActive)) {
+        return;
+    }
+
+    // Same handshake as in disable(): mBusy is visible before mActive is read again
+    android_atomic_inc(&mBusy);
+    android_memory_barrier();
+    if (android_atomic_acquire_load(&mActive) && (mSeen++ % mInterval) == 0 &&
+            (mMaxFrames == 0 || mCaptured < (uint32_t)mMaxFrames)) {
+        int32_t head = mHead;
+        if (head - android_atomic_acquire_load(&mTail) >= mSlots ||
+                sizeof(RawFrameHeader) + size > mSlotSize) {
+            mDropped++;
+        } else {
+            char *slot = mRing + (head % mSlots) * mSlotSize;
+            RawFrameHeader *header = (RawFrameHeader *)slot;
+            header->magic = kRawFrameMagic;
+            header->sequence = mSeen - 1;
+            header->timestamp = systemTime();
+            header->width = mWidth;
+            header->height = mHeight;
+            header->format = mFormat;
+            header->size = size;
+            memcpy(slot + sizeof(RawFrameHeader), frame, size);
+
+            android_atomic_release_store(head + 1, &mHead);
+            mCaptured++;
+            sem_post(&mQueued);
+        }
+    }
+    android_atomic_dec(&mBusy);
+}
+
+bool RawFrameTap::writeNext()
+{
+    sem_wait(&mQueued);
+
+    int32_t tail = mTail;
+    while (tail != android_atomic_acquire_load(&mHead)) {
+        char *slot = mRing + (tail % mSlots) * mSlotSize;
+        RawFrameHeader *header = (RawFrameHeader *)slot;
+        // Header and payload are contiguous: one large sequential write per frame
+        ssize_t length = sizeof(RawFrameHeader) + header->size;
+        if (write(mFd, slot, length) == length) {
+            mWritten++;
+        } else {
+            mWriteErrors++;
+        }
+        android_atomic_release_store(++tail, &mTail);
+    }
+    return true;
+}
+
+void RawFrameTap::dump(int fd) const
+{
+    char buffer[256];
+
+    snprintf(buffer, sizeof(buffer),
+             "Camera %d frame tap: %s, captured %u written %u dropped %u write errors %u\n",
+             mCameraId, mActive ? "on" : "off", mCaptured, mWritten, mDropped, mWriteErrors);
+    write(fd, buffer, strlen(buffer));
+}
+
+}; // namespace android
@@ -0,0 +1,114 @@
+/*
+ * Copyright (C) 2012, rondoval
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_HARDWARE_CAMERA_RAW_FRAME_TAP_H
+#define ANDROID_HARDWARE_CAMERA_RAW_FRAME_TAP_H
+
+#include <semaphore.h>
+#include <utils/threads.h>
+#include <utils/Timers.h>
+
+namespace android {
+
+/**
+ * Header written in front of every frame in a tap file. Frames are stored
+ * back to back, exactly as the legacy driver handed them over.
+ */
+struct RawFrameHeader {
+    uint32_t magic;         /* kRawFrameMagic */
+    uint32_t sequence;      /* preview frame number since the tap was enabled */
+    int64_t  timestamp;     /* systemTime() when the frame was captured */
+    uint32_t width;
+    uint32_t height;
+    uint32_t format;        /* OverlayFormats value */
+    uint32_t size;          /* payload bytes following this header */
+};
+
+/**
+ * Debug tap that saves raw preview frames of one camera to disk.
+ *
+ * capture() runs on the legacy callback thread: it only copies the selected
+ * frame into a ring preallocated by enable() and never blocks. If the ring is
+ * full the frame is dropped and counted. A background writer drains the ring
+ * with one write per frame, appending to a single file per session.
+ */
+class RawFrameTap {
+public:
+    enum { kRawFrameMagic = 0x50415452 /* "RTAP" */ };
+
+    RawFrameTap(int cameraId);
+    ~RawFrameTap();
+
+    /**
+     * Start a capture session: keep every interval'th frame, at most
+     * maxFrames of them (0 means no limit), each at most frameSize bytes.
+     */
+    status_t enable(const char *dir, size_t frameSize, int width, int height, int format,
+                    int interval, int maxFrames, int slots);
+
+    /** Stop capturing, flush what is queued and close the file. */
+    void disable();
+
+    bool enabled() const { return mActive != 0; }
+
+    /** Producer side, called for every preview frame. */
+    void capture(const char *frame, size_t size);
+
+    void dump(int fd) const;
+
+private:
+    class Writer : public Thread {
+    public:
+        Writer(RawFrameTap *tap) : Thread(false), mTap(tap) { }
+    private:
+        virtual bool threadLoop() { return mTap->writeNext(); }
+        RawFrameTap *mTap;
+    };
+
+    bool writeNext();
+    void releaseRing();
+
+    int                 mCameraId;
+    Mutex               mLock;          /* serializes enable()/disable() */
+    sp<Writer>          mWriter;
+    int                 mFd;
+
+    volatile int32_t    mActive;
+    volatile int32_t    mBusy;          /* producer is inside capture() */
+
+    char               *mRing;
+    size_t              mSlotSize;      /* header + frameSize, 32 bit aligned */
+    int                 mSlots;
+    volatile int32_t    mHead;          /* written by the producer */
+    volatile int32_t    mTail;          /* written by the writer */
+    sem_t               mQueued;
+
+    uint32_t            mWidth;
+    uint32_t            mHeight;
+    uint32_t            mFormat;
+    int                 mInterval;
+    int                 mMaxFrames;
+
+    uint32_t            mSeen;          /* frames offered since enable() */
+    uint32_t            mCaptured;
+    uint32_t            mDropped;       /* ring full or frame too large */
+    uint32_t            mWritten;
+    uint32_t            mWriteErrors;
+};
+
+}; // namespace android
+
+#endif
@@ -27,16 +27,28 @@
  *              commit f24c4cd0f204068a17f61f1c195ccf140c6c1d67.
  *            - some wrapper functions are needed (please see the libui.patch)
  * 2012/02/19 - Generic cleanup and overlay support (for Milestone 2)
+ * 2012/03/04 - Per-device preview worker threads, so that several cameras can
+ *              be open at once without one starving the other
+ * 2012/03/06 - Cheaper preview conversion tiers, picked by a governor when
+ *              conversion can't keep up with the frame rate
+ * 2012/03/08 - Raw preview frame tap for debugging, written to disk from a
+ *              background thread
+ * 2012/03/11 - Optional luma statistics gathered during preview conversion
+ * 2012/03/14 - Tiled conversion with wide stores to gralloc memory
  */
 
 #define LOG_TAG "CameraHAL"
 //#define LOG_NDEBUG 0
 
 #include "CameraHardwareInterface.h"
+#include "PreviewConverter.h"
+#include "PreviewWorker.h"
+#include "RawFrameTap.h"
 #include <hardware/camera.h>
 #include <binder/IMemory.h>
 #include <hardware/gralloc.h>
 #include <utils/Errors.h>
+#include <cutils/properties.h>
 
 /* Prototypes and extern functions. */
 extern "C" android::sp<android::CameraHardwareInterface> HAL_openCameraHardware(int cameraId);
@@ -71,6 +83,26 @@ camera_module_t HAL_MODULE_INFO_SYM = {
 
 namespace android {
 
+/*
+ * Private send_command() ids, handled by the wrapper and never passed on to
+ * the legacy driver.
+ *
+ * CAMERA_CMD_SHIM_FRAME_TAP: arg1 = save every arg1'th preview frame (0 turns
+ * the tap off), arg2 = stop after that many frames (0 = no limit).
+ */
+enum {
+   CAMERA_CMD_SHIM_FRAME_TAP = 0x7a000001,
+};
+
+/*
+ * Private message type, outside of CAMERA_MSG_ALL_MSGS. When enabled, every
+ * converted preview frame is followed by a data callback carrying a
+ * camera_luma_stats_t (see PreviewConverter.h) gathered during conversion.
+ */
+enum {
+   CAMERA_MSG_SHIM_LUMA_STATS = 0x00010000,
+};
+
 struct legacy_camera_device {
    camera_device_t device;
    int id;
@@ -93,6 +125,12 @@ struct legacy_camera_device {
    int32_t                               previewHeight;
    OverlayFormats                        previewFormat;
    uint32_t                              previewBpp;
+   sp<PreviewWorker>                     previewWorker;
+   PreviewGovernor                       governor;
+   int                                   convertFlags;
+   RawFrameTap                          *frameTap;
+   bool                                  lumaStatsEnabled;
+   camera_memory_t                      *lumaStatsMemory;
 };
 
 /** camera_hw_device implementation **/
@@ -100,103 +138,32 @@ static inline struct legacy_camera_device * to_lcdev(struct camera_device *dev)
     return reinterpret_cast<struct legacy_camera_device *>(dev);
 }
 
-//
-// http://code.google.com/p/android/issues/detail?id=823#c4
-//
-void Yuv420spToRgba8888(char* rgb, char* yuv420sp, int width, int height) {
-    int frameSize = width * height;
-    int colr = 0;
-    for (int j = 0, yp = 0, k = 0; j < height; j++) {
-        int uvp = frameSize + (j >> 1) * width, u = 0, v = 0;
-        for (int i = 0; i < width; i++, yp++) {
-            int y = (0xff & ((int) yuv420sp[yp])) - 16;
-            if (y < 0) y = 0;
-            if ((i & 1) == 0) {
-                v = (0xff & yuv420sp[uvp++]) - 128;
-                u = (0xff & yuv420sp[uvp++]) - 128;
-            }
-
-            int y1192 = 1192 * y;
-            int r = (y1192 + 1634 * v);
-            int g = (y1192 - 833 * v - 400 * u);
-            int b = (y1192 + 2066 * u);
-
-            if (r < 0) r = 0; else if (r > 262143) r = 262143;
-            if (g < 0) g = 0; else if (g > 262143) g = 262143;
-            if (b < 0) b = 0; else if (b > 262143) b = 262143;
-
-            /* for RGB8888 */
-            r = (r >> 10) & 0xff;
-            g = (g >> 10) & 0xff;
-            b = (b >> 10) & 0xff;
-
-            rgb[k++] = r;
-            rgb[k++] = g;
-            rgb[k++] = b;
-            rgb[k++] = 255;
-        }
+/* Hand the statistics of the frame just converted to the client */
+void CameraHAL_PostLumaStats(const LumaStats *stats, legacy_camera_device *lcdev) {
+    camera_memory_t *mem = lcdev->lumaStatsMemory;
+    if (mem == NULL || lcdev->data_callback == NULL) {
+        return;
     }
-}
-
-void Yuv422iToRgba8888 (char* rgb, char* yuv422i, int width, int height) {
-    int yuv_index = 0;
-    int rgb_index = 0;
-    int frame_size = width * height;
-
-    for (int i = 0; i < frame_size/2; i++) {
-
-            int y1 = (0xff & ((int) yuv422i[yuv_index++])) - 16;
-            if (y1 < 0) y1 = 0;
-
-            int u = (0xff & yuv422i[yuv_index++]) - 128;
-
-            int y2 = (0xff & ((int) yuv422i[yuv_index++])) - 16;
-            if (y2 < 0) y2 = 0;
-
-            int v = (0xff & yuv422i[yuv_index++]) - 128;
-
-            int y1192 = 1192 * y1;
-            int r = (y1192 + 1634 * v);
-            int g = (y1192 - 833 * v - 400 * u);
-            int b = (y1192 + 2066 * u);
-
-            if (r < 0) r = 0; else if (r > 262143) r = 262143;
-            if (g < 0) g = 0; else if (g > 262143) g = 262143;
-            if (b < 0) b = 0; else if (b > 262143) b = 262143;
-
-            /* for RGB8888 */
-            r = (r >> 10) & 0xff;
-            g = (g >> 10) & 0xff;
-            b = (b >> 10) & 0xff;
 
-            rgb[rgb_index++] = r;
-            rgb[rgb_index++] = g;
-            rgb[rgb_index++] = b;
-            rgb[rgb_index++] = 255;
-
-            y1192 = 1192 * y2;
-            r = (y1192 + 1634 * v);
-            g = (y1192 - 833 * v - 400 * u);
-            b = (y1192 + 2066 * u);
-
-            if (r < 0) r = 0; else if (r > 262143) r = 262143;
-            if (g < 0) g = 0; else if (g > 262143) g = 262143;
-            if (b < 0) b = 0; else if (b > 262143) b = 262143;
-
-            /* for RGB8888 */
-            r = (r >> 10) & 0xff;
-            g = (g >> 10) & 0xff;
-            b = (b >> 10) & 0xff;
-
-            rgb[rgb_index++] = r;
-            rgb[rgb_index++] = g;
-            rgb[rgb_index++] = b;
-            rgb[rgb_index++] = 255;
-    }
+    camera_luma_stats_t *out = (camera_luma_stats_t *) mem->data;
+    out->version = CAMERA_LUMA_STATS_VERSION;
+    out->width = lcdev->previewWidth;
+    out->height = lcdev->previewHeight;
+    finishLumaStats(stats, out);
+    lcdev->data_callback(CAMERA_MSG_SHIM_LUMA_STATS, mem, 0, NULL, lcdev->user);
 }
 
-void CameraHAL_ProcessPreviewData(char *frame, size_t size, legacy_camera_device *lcdev) {
+/* Returns the time spent converting the frame, -1 if it never got that far */
+nsecs_t CameraHAL_ProcessPreviewData(char *frame, size_t size, legacy_camera_device *lcdev) {
     LOGV("%s: frame=%p, size=%d, camera=%p", __FUNCTION__, frame, size, lcdev);
+    LumaStats stats;
+    LumaStats *pstats = NULL;
+    nsecs_t convertTime = -1;
+    if (lcdev->lumaStatsEnabled && lcdev->previewFormat != OVERLAY_FORMAT_RGBA8888) {
+        memset(&stats, 0, sizeof(stats));
+        pstats = &stats;
+    }
+
     if (NULL != lcdev->window && NULL != lcdev->request_memory) {
         int32_t stride;
         buffer_handle_t *bufHandle = NULL;
@@ -225,12 +192,15 @@ void CameraHAL_ProcessPreviewData(char *frame, size_t size, legacy_camera_device
                 }
                 if (!err) {
                     // The data we get is in YUV... but Window is RGBA8888. It needs to be converted
+                    nsecs_t start = systemTime();
                     switch (lcdev->previewFormat) {
                         case OVERLAY_FORMAT_YUV422I:
-                            Yuv422iToRgba8888((char*)vaddr, frame, lcdev->previewWidth, lcdev->previewHeight);
+                            Yuv422iToRgba8888((char*)vaddr, frame, lcdev->previewWidth, lcdev->previewHeight,
+                                              lcdev->governor.tier(), lcdev->convertFlags, pstats);
                             break;
                         case OVERLAY_FORMAT_YUV420SP:
-                            Yuv420spToRgba8888((char*)vaddr, frame, lcdev->previewWidth, lcdev->previewHeight);
+                            Yuv420spToRgba8888((char*)vaddr, frame, lcdev->previewWidth, lcdev->previewHeight,
+                                               lcdev->governor.tier(), lcdev->convertFlags, pstats);
                             break;
                         case OVERLAY_FORMAT_RGBA8888:
                             memcpy(vaddr, frame, size);
@@ -238,11 +208,15 @@ void CameraHAL_ProcessPreviewData(char *frame, size_t size, legacy_camera_device
                         default:
                             LOGE("%s: Unknown video format, cannot convert!", __FUNCTION__);
                     }
+                    convertTime = systemTime() - start;
 
                     lcdev->gralloc->unlock(lcdev->gralloc, *bufHandle);
                     if (0 != lcdev->window->enqueue_buffer(lcdev->window, bufHandle)) {
                         LOGE("%s: could not enqueue gralloc buffer", __FUNCTION__);
                     }
+                    if (pstats != NULL) {
+                        CameraHAL_PostLumaStats(pstats, lcdev);
+                    }
                 } else {
                     LOGE("%s: could not lock gralloc buffer", __FUNCTION__);
                 }
@@ -254,12 +228,32 @@ void CameraHAL_ProcessPreviewData(char *frame, size_t size, legacy_camera_device
             LOGE("%s: ERROR dequeueing the buffer", __FUNCTION__);
          }
     }
+    return convertTime;
+}
+
+/*
+ * Runs on the device's preview worker, with its render lock held. Only the
+ * conversion is timed for the governor: dequeue/enqueue mostly wait for
+ * vsync and the compositor, which a cheaper tier would not speed up.
+ */
+void CameraHAL_RenderPreviewFrame(char *frame, size_t size, void *cookie) {
+  struct legacy_camera_device *lcdev = (struct legacy_camera_device *) cookie;
+  nsecs_t convertTime = CameraHAL_ProcessPreviewData(frame, size, lcdev);
+  if (convertTime >= 0) {
+    lcdev->governor.update(convertTime, lcdev->previewWorker->frameInterval());
+  }
+}
+
+/* Called on the legacy callback thread for every preview frame */
+void CameraHAL_PostPreviewFrame(char *frame, size_t size, legacy_camera_device *lcdev) {
+  lcdev->frameTap->capture(frame, size);
+  lcdev->previewWorker->post(frame, size);
 }
 
 /* Overlay hooks */
 void queue_buffer_hook(void *data, void *buffer, size_t size) {
   if (data != NULL && buffer != NULL) {
-      CameraHAL_ProcessPreviewData((char*)buffer, size, (legacy_camera_device*) data);
+      CameraHAL_PostPreviewFrame((char*)buffer, size, (legacy_camera_device*) data);
   }
 }
 
@@ -271,7 +265,7 @@ void CameraHAL_HandlePreviewData(const sp<IMemory>& dataPtr, void* user) {
        size_t   size;
        sp<IMemoryHeap> mHeap = dataPtr->getMemory(&offset, &size);
        char* buffer = (char*)mHeap->getBase() + offset;
-       CameraHAL_ProcessPreviewData(buffer, size, lcdev);
+       CameraHAL_PostPreviewFrame(buffer, size, lcdev);
   }
 }
 
@@ -373,6 +367,71 @@ int CameraHAL_GetCam_Info(int camera_id, struct camera_info *info) {
    return rv;
 }
 
+/*
+ * Times preview conversion into a cached heap buffer and into a locked
+ * gralloc buffer of the window, with and without tiling, and logs the
+ * results. Enabled with debug.camerashim.benchmark=1; called with the
+ * render lock held, after the window geometry has been set.
+ */
+void CameraHAL_BenchmarkConversion(struct legacy_camera_device *lcdev) {
+  const int kIterations = 10;
+  int width = lcdev->previewWidth;
+  int height = lcdev->previewHeight;
+  bool yuv422i = lcdev->previewFormat == OVERLAY_FORMAT_YUV422I;
+  nsecs_t cached[2] = { -1, -1 };
+  nsecs_t gralloc[2] = { -1, -1 };
+
+  char *heap = (char *)malloc(width * height * 4);
+  if (heap != NULL) {
+      cached[0] = benchmarkConversion(heap, width, height, yuv422i, lcdev->governor.tier(), 0, kIterations);
+      cached[1] = benchmarkConversion(heap, width, height, yuv422i, lcdev->governor.tier(),
+                                      PREVIEW_CONVERT_TILED, kIterations);
+      free(heap);
+  }
+
+  int32_t stride;
+  buffer_handle_t *bufHandle = NULL;
+  if (lcdev->window->dequeue_buffer(lcdev->window, &bufHandle, &stride) == NO_ERROR) {
+      void *vaddr;
+      if (lcdev->gralloc->lock(lcdev->gralloc, *bufHandle, GRALLOC_USAGE_SW_WRITE_OFTEN,
+                               0, 0, width, height, &vaddr) == 0) {
+          gralloc[0] = benchmarkConversion((char *)vaddr, width, height, yuv422i,
+                                           lcdev->governor.tier(), 0, kIterations);
+          gralloc[1] = benchmarkConversion((char *)vaddr, width, height, yuv422i,
+                                           lcdev->governor.tier(), PREVIEW_CONVERT_TILED, kIterations);
+          lcdev->gralloc->unlock(lcdev->gralloc, *bufHandle);
+      }
+      lcdev->window->cancel_buffer(lcdev->window, bufHandle);
+  }
+
+  LOGI("%s: %dx%d %s tier %d: heap %lld/%lld us, gralloc %lld/%lld us (direct/tiled)",
+       __FUNCTION__, width, height, yuv422i ? "yuv422i" : "yuv420sp", lcdev->governor.tier(),
+       ns2us(cached[0]), ns2us(cached[1]), ns2us(gralloc[0]), ns2us(gralloc[1]));
+}
+
+int CameraHAL_EnableFrameTap(struct legacy_camera_device *lcdev, int interval, int maxFrames)
+{
+  char dir[PROPERTY_VALUE_MAX];
+  char slots[PROPERTY_VALUE_MAX];
+  property_get("debug.camerashim.tap.dir", dir, "/data/local/tmp");
+  property_get("debug.camerashim.tap.slots", slots, "8");
+
+  int32_t width = lcdev->previewWidth;
+  int32_t height = lcdev->previewHeight;
+  OverlayFormats format = lcdev->previewFormat;
+  if (width == 0 || height == 0) {
+      // No window yet, ask the driver
+      CameraParameters params(lcdev->hwif->getParameters());
+      params.getPreviewSize(&width, &height);
+      format = getOverlayFormatFromString(params.getPreviewFormat());
+  }
+
+  // Upper bound: all YUV formats we handle fit in 2 bytes per pixel
+  size_t frameSize = width * height * (format == OVERLAY_FORMAT_RGBA8888 ? 4 : 2);
+  return lcdev->frameTap->enable(dir, frameSize, width, height, format, interval, maxFrames,
+                                 atoi(slots));
+}
+
 void CameraHAL_FixupParams(CameraParameters &settings)
 {
 #ifdef MOTOROLA_CAMERA
@@ -395,6 +454,7 @@ int camera_set_preview_window(struct camera_device * device, struct preview_stre
       return -EINVAL;
   }
 
+  Mutex::Autolock lock(lcdev->previewWorker->renderLock());
   if (lcdev->window == window) {
       return 0;
   }
@@ -463,6 +523,12 @@ int camera_set_preview_window(struct camera_device * device, struct preview_stre
      lcdev->hwif->setOverlay(lcdev->overlay);
   }
 
+  char benchmark[PROPERTY_VALUE_MAX];
+  property_get("debug.camerashim.benchmark", benchmark, "0");
+  if (atoi(benchmark) && lcdev->gralloc != NULL && lcdev->previewFormat != OVERLAY_FORMAT_RGBA8888) {
+     CameraHAL_BenchmarkConversion(lcdev);
+  }
+
   return NO_ERROR;
 }
 
@@ -488,24 +554,65 @@ void camera_set_callbacks(struct camera_device * device,
 void camera_enable_msg_type(struct camera_device * device, int32_t msg_type) {
    struct legacy_camera_device *lcdev = to_lcdev(device);
    LOGV("camera_enable_msg_type: msg_type:%d\n", msg_type);
+
+   if (msg_type & CAMERA_MSG_SHIM_LUMA_STATS) {
+      Mutex::Autolock lock(lcdev->previewWorker->renderLock());
+      if (lcdev->lumaStatsMemory == NULL && lcdev->request_memory != NULL) {
+         lcdev->lumaStatsMemory = lcdev->request_memory(-1, sizeof(camera_luma_stats_t), 1, lcdev->user);
+      }
+      lcdev->lumaStatsEnabled = lcdev->lumaStatsMemory != NULL;
+      msg_type &= ~CAMERA_MSG_SHIM_LUMA_STATS;
+   }
+
    lcdev->hwif->enableMsgType(msg_type);
 }
 
 void camera_disable_msg_type(struct camera_device * device, int32_t msg_type) {
    struct legacy_camera_device *lcdev = to_lcdev(device);
    LOGV("camera_disable_msg_type: msg_type:%d\n", msg_type);
+
+   if (msg_type & CAMERA_MSG_SHIM_LUMA_STATS) {
+      Mutex::Autolock lock(lcdev->previewWorker->renderLock());
+      lcdev->lumaStatsEnabled = false;
+      if (lcdev->lumaStatsMemory != NULL) {
+         lcdev->lumaStatsMemory->release(lcdev->lumaStatsMemory);
+         lcdev->lumaStatsMemory = NULL;
+      }
+      msg_type &= ~CAMERA_MSG_SHIM_LUMA_STATS;
+   }
+
    lcdev->hwif->disableMsgType(msg_type);
 }
 
 int camera_msg_type_enabled(struct camera_device * device, int32_t msg_type) {
    struct legacy_camera_device *lcdev = to_lcdev(device);
    LOGV("camera_msg_type_enabled: msg_type:%d\n", msg_type);
+
+   if (msg_type & CAMERA_MSG_SHIM_LUMA_STATS) {
+      msg_type &= ~CAMERA_MSG_SHIM_LUMA_STATS;
+      if (!lcdev->lumaStatsEnabled) {
+         return 0;
+      }
+      if (msg_type == 0) {
+         return 1;
+      }
+   }
+
    return lcdev->hwif->msgTypeEnabled(msg_type);
 }
 
 int camera_start_preview(struct camera_device * device) {
    struct legacy_camera_device *lcdev = to_lcdev(device);
    LOGV("camera_start_preview:\n");
+
+   char tap[PROPERTY_VALUE_MAX];
+   property_get("debug.camerashim.tap", tap, "0");
+   if (atoi(tap) > 0 && !lcdev->frameTap->enabled()) {
+      char max[PROPERTY_VALUE_MAX];
+      property_get("debug.camerashim.tap.max", max, "0");
+      CameraHAL_EnableFrameTap(lcdev, atoi(tap), atoi(max));
+   }
+
    return lcdev->hwif->startPreview();
 }
 
@@ -513,6 +620,8 @@ void camera_stop_preview(struct camera_device * device) {
    struct legacy_camera_device *lcdev = to_lcdev(device);
    LOGV("camera_stop_preview:\n");
    lcdev->hwif->stopPreview();
+   lcdev->previewWorker->flush();
+   lcdev->frameTap->disable();
    return;
 }
 
@@ -615,6 +724,15 @@ void camera_put_parameters(struct camera_device *device, char *params) {
 int camera_send_command(struct camera_device * device, int32_t cmd, int32_t arg0, int32_t arg1) {
    struct legacy_camera_device *lcdev = to_lcdev(device);
    LOGV("camera_send_command: cmd:%d arg0:%d arg1:%d\n", cmd, arg0, arg1);
+
+   if (cmd == CAMERA_CMD_SHIM_FRAME_TAP) {
+      if (arg0 <= 0) {
+         lcdev->frameTap->disable();
+         return NO_ERROR;
+      }
+      return CameraHAL_EnableFrameTap(lcdev, arg0, arg1);
+   }
+
    return lcdev->hwif->sendCommand(cmd, arg0, arg1);
 }
 
@@ -627,6 +745,15 @@ void camera_release(struct camera_device * device) {
 int camera_dump(struct camera_device * device, int fd) {
    struct legacy_camera_device *lcdev = to_lcdev(device);
    LOGV("camera_dump:\n");
+   lcdev->previewWorker->dump(fd);
+   lcdev->frameTap->dump(fd);
+
+   char buffer[128];
+   snprintf(buffer, sizeof(buffer), "Camera %d preview tier %d (%s), process avg %lld us\n",
+            lcdev->id, lcdev->governor.tier(), lcdev->governor.automatic() ? "auto" : "fixed",
+            ns2us(lcdev->governor.averageProcessTime()));
+   write(fd, buffer, strlen(buffer));
+
    Vector<String16> args;
    return lcdev->hwif->dump(fd, args);
 }
@@ -639,9 +766,18 @@ int camera_device_close(hw_device_t* device) {
    if (lcdev != NULL) {
       camera_device_ops_t *camera_ops = lcdev->device.ops;
       if (camera_ops) {
+         // Stop rendering first; the driver may still post until hwif goes away
+         if (lcdev->previewWorker != NULL) {
+            lcdev->previewWorker->stop();
+         }
          if (lcdev->hwif != NULL) {
             lcdev->hwif.clear();
          }
+         lcdev->previewWorker.clear();
+         delete lcdev->frameTap;
+         if (lcdev->lumaStatsMemory != NULL) {
+            lcdev->lumaStatsMemory->release(lcdev->lumaStatsMemory);
+         }
          free(camera_ops);
       }
       free(lcdev);
@@ -701,15 +837,39 @@ int camera_device_open(const hw_module_t* module, const char* name, hw_device_t*
    camera_ops->dump                       = camera_dump;
 
    lcdev->id = cameraId;
+
+   // -1 lets the governor pick the conversion tier, 0..3 pins it
+   char tier[PROPERTY_VALUE_MAX];
+   property_get("debug.camerashim.preview_tier", tier, "-1");
+   lcdev->governor.init(atoi(tier));
+
+   // Tiled conversion pays off on write-combined/uncached gralloc memory
+   char tiled[PROPERTY_VALUE_MAX];
+   property_get("debug.camerashim.tiled", tiled, "1");
+   lcdev->convertFlags = atoi(tiled) ? PREVIEW_CONVERT_TILED : 0;
+   lcdev->frameTap = new RawFrameTap(cameraId);
+
    lcdev->hwif = HAL_openCameraHardware(cameraId);
    if (lcdev->hwif == NULL) {
        ret = -EIO;
        goto err_create_camera_hw;
    }
+
+   char workerName[32];
+   snprintf(workerName, sizeof(workerName), "CameraHAL-preview-%d", cameraId);
+   lcdev->previewWorker = new PreviewWorker(cameraId, CameraHAL_RenderPreviewFrame, lcdev);
+   if (lcdev->previewWorker->run(workerName, PRIORITY_URGENT_DISPLAY) != NO_ERROR) {
+       LOGE("%s: could not start preview worker", __FUNCTION__);
+       lcdev->previewWorker.clear();
+       lcdev->hwif.clear();
+       ret = -EIO;
+       goto err_create_camera_hw;
+   }
    *device = &lcdev->device.common;
    return NO_ERROR;
 
 err_create_camera_hw:
+   delete lcdev->frameTap;
    free(lcdev);
    free(camera_ops);
    return ret;
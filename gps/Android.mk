@@ -9,13 +9,25 @@ LOCAL_MODULE := gps.$(TARGET_BOOTLOADER_BOARD_NAME)
 
 LOCAL_SHARED_LIBRARIES:= \
 	liblog \
-    $(BOARD_GPS_LIBRARIES) \
+	libcutils \
+	libdl \
+
+# The legacy library is dlopen()ed on first use, see gps.c
+LOCAL_REQUIRED_MODULES := $(BOARD_GPS_LIBRARIES)
 
 LOCAL_SRC_FILES += \
-    gps.c
+    gps.c \
+    nmea.c \
+    persist.c \
+    xtra_cache.c \
+    trace.c \
+    feed.c \
+    geofence.c \
+    policy.c
 
 LOCAL_CFLAGS += \
-    -fno-short-enums 
+    -fno-short-enums \
+    -DGPS_LIBRARIES="\"$(strip $(BOARD_GPS_LIBRARIES))\""
 
 ifneq ($(BOARD_GPS_BAD_AGPS),)
 LOCAL_CFLAGS += \
@@ -32,4 +44,6 @@ LOCAL_MODULE_PATH := $(TARGET_OUT_SHARED_LIBRARIES)/hw
 
 include $(BUILD_SHARED_LIBRARY)
 
+include $(call all-makefiles-under,$(LOCAL_PATH))
+
 endif # BOARD_VENDOR_QCOM_GPS_LOC_API_HARDWARE
@@ -0,0 +1,247 @@
+/******************************************************************************
+ * GPS HAL shim - shared memory fix and NMEA feed
+ *
+ * Copyright (C) 2012, rondoval
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ ******************************************************************************/
+
+
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#define LOG_TAG "gps-shim"
+#include <utils/Log.h>
+#include <cutils/ashmem.h>
+#include <cutils/atomic.h>
+#include <cutils/atomic-inline.h>
+#include <cutils/sockets.h>
+
+#include "feed.h"
+
+#define FEED_MAX_UID        10000   /* AID_APP: applications go through LocationManager */
+
+static GpsFeedHeader *feedHeader = NULL;
+static GpsFeedSlot *feedSlots = NULL;
+static size_t feedSize = 0;
+static int feedFd = -1;
+static int feedServer = -1;
+static volatile int32_t feedLive = 0;  /* the mapping may be written */
+static volatile int32_t feedBusy = 0;  /* writers past the feedLive check */
+static pthread_t feedThread;
+static uint32_t feedClients = 0;
+static uint32_t feedRefused = 0;
+static uint32_t feedTooLong = 0;
+
+/* Hand the region fd to one client */
+static void feed_serve(int client) {
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    struct ucred cred;
+    socklen_t length = sizeof(cred);
+    char control[CMSG_SPACE(sizeof(int))];
+    char version = GPS_FEED_VERSION;
+
+    if (getsockopt(client, SOL_SOCKET, SO_PEERCRED, &cred, &length) || cred.uid >= FEED_MAX_UID) {
+        feedRefused++;
+        return;
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = &version;
+    iov.iov_len = 1;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &feedFd, sizeof(int));
+    if (sendmsg(client, &msg, 0) == 1)
+        feedClients++;
+}
+
+/* Blocks in accept(), so it costs nothing until a client shows up */
+static void* feed_loop(void *unused) {
+    int client;
+
+    for (;;) {
+        client = accept(feedServer, NULL, NULL);
+        if (client < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            break;
+        }
+        feed_serve(client);
+        close(client);
+    }
+    return NULL;
+}
+
+int feed_start() {
+    if (feedHeader != NULL)
+        return 0;
+
+    feedSize = sizeof(GpsFeedHeader) + GPS_FEED_SLOTS * sizeof(GpsFeedSlot);
+    feedFd = ashmem_create_region("gpsshim-feed", feedSize);
+    if (feedFd < 0) {
+        LOGW("Could not create the feed region");
+        return -1;
+    }
+    feedHeader = mmap(NULL, feedSize, PROT_READ | PROT_WRITE, MAP_SHARED, feedFd, 0);
+    if (feedHeader == MAP_FAILED) {
+        LOGW("Could not map the feed region: %s", strerror(errno));
+        goto fail;
+    }
+    /* Our mapping stays writable, clients only get to map it read-only */
+    ashmem_set_prot_region(feedFd, PROT_READ);
+
+    memset(feedHeader, 0, feedSize);
+    feedHeader->magic = GPS_FEED_MAGIC;
+    feedHeader->version = GPS_FEED_VERSION;
+    feedHeader->slots = GPS_FEED_SLOTS;
+    feedHeader->slot_size = sizeof(GpsFeedSlot);
+    feedSlots = (GpsFeedSlot *)(feedHeader + 1);
+
+    feedServer = socket_local_server(GPS_FEED_SOCKET, ANDROID_SOCKET_NAMESPACE_ABSTRACT, SOCK_STREAM);
+    if (feedServer < 0) {
+        LOGW("Could not listen on @%s: %s", GPS_FEED_SOCKET, strerror(errno));
+        goto fail;
+    }
+    feedClients = feedRefused = feedTooLong = 0;
+    pthread_create(&feedThread, NULL, feed_loop, NULL);
+    android_atomic_release_store(1, &feedLive);
+    LOGI("Feeding fixes and NMEA to @%s", GPS_FEED_SOCKET);
+    return 0;
+
+fail:
+    if (feedHeader != MAP_FAILED && feedHeader != NULL)
+        munmap(feedHeader, feedSize);
+    feedHeader = NULL;
+    feedSlots = NULL;
+    close(feedFd);
+    feedFd = -1;
+    return -1;
+}
+
+void feed_stop() {
+    if (feedHeader == NULL)
+        return;
+    /*
+     * Same handshake as feed_enter(): once feedLive is clear and no writer
+     * is busy, nothing touches the mapping any more
+     */
+    android_atomic_release_store(0, &feedLive);
+    android_memory_barrier();
+    while (android_atomic_acquire_load(&feedBusy))
+        usleep(1000);
+
+    /* Wakes up accept() */
+    shutdown(feedServer, SHUT_RDWR);
+    pthread_join(feedThread, NULL);
+    close(feedServer);
+    feedServer = -1;
+
+    android_atomic_release_store(1, (volatile int32_t *)&feedHeader->closed);
+    LOGI("Feed closed after %u entries, %u clients served, %u refused, %u sentences too long",
+         feedHeader->head, feedClients, feedRefused, feedTooLong);
+    munmap(feedHeader, feedSize);
+    feedHeader = NULL;
+    feedSlots = NULL;
+    close(feedFd);
+    feedFd = -1;
+}
+
+/* Keeps the mapping alive until feed_leave(); 0 if the feed is not running */
+static int feed_enter() {
+    if (!android_atomic_acquire_load(&feedLive))
+        return 0;
+    android_atomic_inc(&feedBusy);
+    android_memory_barrier();
+    if (android_atomic_acquire_load(&feedLive))
+        return 1;
+    android_atomic_dec(&feedBusy);
+    return 0;
+}
+
+static void feed_leave() {
+    android_atomic_dec(&feedBusy);
+}
+
+/* Single writer: the legacy callback thread */
+static GpsFeedSlot* feed_begin(int type, int64_t timestamp) {
+    uint32_t entry = feedHeader->head;
+    GpsFeedSlot *slot = &feedSlots[entry % GPS_FEED_SLOTS];
+
+    android_atomic_release_store(slot->sequence + 1, (volatile int32_t *)&slot->sequence);
+    android_memory_barrier();
+    slot->entry = entry;
+    slot->type = type;
+    slot->timestamp = timestamp;
+    return slot;
+}
+
+static void feed_end(GpsFeedSlot *slot) {
+    android_atomic_release_store(slot->sequence + 1, (volatile int32_t *)&slot->sequence);
+    android_atomic_release_store(feedHeader->head + 1, (volatile int32_t *)&feedHeader->head);
+}
+
+void feed_fix(const GpsLocation *location) {
+    GpsFeedSlot *slot;
+
+    if (!feed_enter())
+        return;
+    slot = feed_begin(GPS_FEED_FIX, location->timestamp);
+    slot->length = 0;
+    slot->u.fix.flags = location->flags;
+    slot->u.fix.reserved = 0;
+    slot->u.fix.latitude = location->latitude;
+    slot->u.fix.longitude = location->longitude;
+    slot->u.fix.altitude = location->altitude;
+    slot->u.fix.speed = location->speed;
+    slot->u.fix.bearing = location->bearing;
+    slot->u.fix.accuracy = location->accuracy;
+    feed_end(slot);
+    feed_leave();
+}
+
+void feed_nmea(GpsUtcTime timestamp, const char *sentence, int length,
+               const NmeaSentence *parsed) {
+    GpsFeedSlot *slot;
+
+    if (!feed_enter())
+        return;
+    if (length >= GPS_FEED_NMEA_MAX) {
+        feedTooLong++;
+        feed_leave();
+        return;
+    }
+    slot = feed_begin(GPS_FEED_NMEA, timestamp);
+    slot->length = length;
+    if (parsed != NULL)
+        slot->u.nmea.parsed = *parsed;
+    else
+        memset(&slot->u.nmea.parsed, 0, sizeof(slot->u.nmea.parsed));
+    memcpy(slot->u.nmea.sentence, sentence, length);
+    slot->u.nmea.sentence[length] = '\0';
+    feed_end(slot);
+    feed_leave();
+}
@@ -0,0 +1,143 @@
+/******************************************************************************
+ * GPS HAL shim - shared memory fix and NMEA feed
+ *
+ * Copyright (C) 2012, rondoval
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ ******************************************************************************/
+
+
+#ifndef GPSSHIM_FEED_H
+#define GPSSHIM_FEED_H
+
+#include <stdint.h>
+#include <string.h>
+#include <hardware/gps.h>
+
+#include "nmea.h"
+
+/*
+ * Local processes that want the raw fix and NMEA stream without going
+ * through LocationManager connect to the abstract unix socket
+ * GPS_FEED_SOCKET and receive, as SCM_RIGHTS ancillary data, the fd of an
+ * ashmem region they can map read-only. The region holds a GpsFeedHeader
+ * followed by a ring of GpsFeedSlot; reading it takes no syscall at all.
+ *
+ * The shim writes entries in order, entry n into slot n % slots, each slot
+ * guarded by a sequence count (odd while it is being written). NMEA entries
+ * carry the sentence as received and, next to it, what nmea_parse() made of
+ * it, so readers need not tokenize it again. A reader
+ * that falls more than a ring behind is told so and skips ahead. When the
+ * shim is cleaned up, closed is set and the region is never written again;
+ * reconnect to get the next one.
+ *
+ * Only root, system and other native daemons (uid below 10000) are served.
+ */
+#define GPS_FEED_SOCKET     "gpsshim-feed"
+#define GPS_FEED_MAGIC      0x44454546      /* "FEED" */
+#define GPS_FEED_VERSION    2
+#define GPS_FEED_SLOTS      512
+#define GPS_FEED_NMEA_MAX   100
+
+enum {
+    GPS_FEED_FIX = 1,
+    GPS_FEED_NMEA,
+};
+
+typedef struct {
+    uint16_t flags;         /* GPS_LOCATION_HAS_* */
+    uint16_t reserved;
+    float    speed;         /* m/s */
+    double   latitude;
+    double   longitude;
+    double   altitude;      /* m above WGS84 */
+    float    bearing;
+    float    accuracy;      /* m */
+} GpsFeedFix;
+
+typedef struct {
+    NmeaSentence parsed;    /* type 0 if the sentence did not parse */
+    char sentence[GPS_FEED_NMEA_MAX];
+} GpsFeedNmea;
+
+typedef struct {
+    volatile uint32_t sequence;
+    uint32_t entry;         /* entry number held by the slot */
+    uint16_t type;          /* GPS_FEED_* */
+    uint16_t length;        /* NMEA bytes, without terminator */
+    uint32_t reserved;
+    int64_t  timestamp;     /* UTC ms */
+    union {
+        GpsFeedFix fix;
+        GpsFeedNmea nmea;
+    } u;
+} GpsFeedSlot;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slots;
+    uint32_t slot_size;
+    volatile uint32_t head;     /* entries written so far */
+    volatile uint32_t closed;
+    uint32_t reserved[2];
+} GpsFeedHeader;
+
+/*
+ * Reader side: copy entry *next into out. Returns 1 and advances *next on
+ * success, 0 if that entry was not written yet, -1 if it has already been
+ * overwritten, in which case *next is moved to the oldest entry still there.
+ */
+static inline int gps_feed_read(const GpsFeedHeader *header, uint32_t *next, GpsFeedSlot *out) {
+    const GpsFeedSlot *slots = (const GpsFeedSlot *)(header + 1);
+    const GpsFeedSlot *slot;
+    uint32_t head, sequence;
+
+    for (;;) {
+        head = header->head;
+        __sync_synchronize();
+        if (head == *next)
+            return 0;
+        if (head - *next > header->slots) {
+            *next = head - header->slots;
+            return -1;
+        }
+        slot = &slots[*next % header->slots];
+        sequence = slot->sequence;
+        __sync_synchronize();
+        if (sequence & 1)
+            continue;
+        memcpy(out, (const void *)slot, sizeof(*out));
+        __sync_synchronize();
+        if (slot->sequence != sequence)
+            continue;
+        if (out->entry != *next) {
+            /* Lapped while looking */
+            *next = header->head - header->slots + 1;
+            return -1;
+        }
+        (*next)++;
+        return 1;
+    }
+}
+
+/* Shim side, called on the legacy callback thread */
+int feed_start();
+void feed_stop();
+void feed_fix(const GpsLocation *location);
+/* parsed is NULL for a sentence nmea_parse() rejected */
+void feed_nmea(GpsUtcTime timestamp, const char *sentence, int length,
+               const NmeaSentence *parsed);
+
+#endif
@@ -0,0 +1,483 @@
+/******************************************************************************
+ * GPS HAL shim - geofencing
+ *
+ * Copyright (C) 2012, rondoval
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ ******************************************************************************/
+
+
+#include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#define LOG_TAG "gps-shim"
+#include <utils/Log.h>
+
+#include <gpsshim.h>
+#include "geofence.h"
+
+#define METERS_PER_DEGREE   111320.0
+#define GEOFENCE_MAX_MARGIN 50.0    /* m */
+#define GEOFENCE_MAX_CELLS  64      /* per fence, larger ones are always tested */
+#define GEOFENCE_BUCKETS    4096    /* power of two */
+#define GEOFENCE_ALWAYS     GEOFENCE_BUCKETS
+
+typedef struct {
+    int32_t id;
+    int     used;
+    int     monitor;
+    uint32_t dwell;
+    /* Shape in meters around a reference point */
+    double  latitude;
+    double  longitude;
+    double  cosLatitude;
+    double  radius;             /* circles */
+    int     count;              /* polygon vertices, 0 for a circle */
+    float   *vertices;          /* x, y pairs */
+    /* Indexed cells */
+    int32_t minLat, maxLat, minLon, maxLon;
+    /* State */
+    int     inside;
+    int     insidePos;          /* in insideList, next free slot once released */
+    int     dwelled;
+    GpsUtcTime entered;
+    uint32_t round;             /* last update that tested the fence */
+} Geofence;
+
+typedef struct {
+    int32_t lat;
+    int32_t lon;
+    int32_t fence;
+    int32_t next;
+} GeofenceCell;
+
+static pthread_mutex_t geofenceLock = PTHREAD_MUTEX_INITIALIZER;
+static double cellDegrees = 2000 / METERS_PER_DEGREE;
+static Geofence *fences = NULL;
+static int fenceCount = 0, fenceCapacity = 0, fenceFree = -1;
+static GeofenceCell *cells = NULL;
+static int cellCapacity = 0, cellFree = -1, cellUsed = 0;
+static int32_t buckets[GEOFENCE_BUCKETS + 1];   /* last one holds the always tested fences */
+static int *insideList = NULL;
+static int insideCount = 0, insideCapacity = 0;
+static uint32_t updateRound = 0;
+static uint32_t fixesTested = 0;
+static uint64_t fencesTested = 0;
+static uint32_t transitions = 0;
+
+static void* grow(void *array, int *capacity, size_t size) {
+    int wanted = *capacity ? *capacity * 2 : 64;
+    void *p = realloc(array, wanted * size);
+
+    if (p != NULL)
+        *capacity = wanted;
+    return p;
+}
+
+/* Degrees east of reference, in [-180, 180), so shapes across the antimeridian stay in one piece */
+static double lon_delta(double longitude, double reference) {
+    double d = fmod(longitude - reference + 180, 360);
+
+    return (d < 0 ? d + 360 : d) - 180;
+}
+
+static int bucket_of(int32_t lat, int32_t lon) {
+    uint32_t h = (uint32_t)lat * 0x9e3779b1u ^ (uint32_t)lon * 0x85ebca6bu;
+    return (h ^ h >> 16) & (GEOFENCE_BUCKETS - 1);
+}
+
+static int cell_add(int bucket, int32_t lat, int32_t lon, int fence) {
+    GeofenceCell *p;
+    int i, old = cellCapacity;
+
+    if (cellFree < 0) {
+        p = grow(cells, &cellCapacity, sizeof(GeofenceCell));
+        if (p == NULL)
+            return -1;
+        cells = p;
+        for (i = cellCapacity - 1; i >= old; i--) {
+            cells[i].next = cellFree;
+            cellFree = i;
+        }
+    }
+    i = cellFree;
+    cellFree = cells[i].next;
+    cells[i].lat = lat;
+    cells[i].lon = lon;
+    cells[i].fence = fence;
+    cells[i].next = buckets[bucket];
+    buckets[bucket] = i;
+    cellUsed++;
+    return 0;
+}
+
+static void cell_remove(int bucket, int fence) {
+    int32_t *link = &buckets[bucket];
+    int i;
+
+    while ((i = *link) >= 0) {
+        if (cells[i].fence == fence) {
+            *link = cells[i].next;
+            cells[i].next = cellFree;
+            cellFree = i;
+            cellUsed--;
+        } else {
+            link = &cells[i].next;
+        }
+    }
+}
+
+static int fence_always(const Geofence *f) {
+    return f->minLat == INT32_MIN;
+}
+
+static void fence_unindex(int index) {
+    Geofence *f = &fences[index];
+    int32_t lat, lon;
+
+    if (fence_always(f)) {
+        cell_remove(GEOFENCE_ALWAYS, index);
+        return;
+    }
+    /* A bucket may hold several cells of the fence, removing them all once is enough */
+    for (lat = f->minLat; lat <= f->maxLat; lat++)
+        for (lon = f->minLon; lon <= f->maxLon; lon++)
+            cell_remove(bucket_of(lat, lon), index);
+}
+
+/* Index a fence by its bounding box, given in degrees */
+static int fence_index(int index, double south, double north, double west, double east) {
+    Geofence *f = &fences[index];
+    int32_t lat, lon;
+
+    f->minLat = floor(south / cellDegrees);
+    f->maxLat = floor(north / cellDegrees);
+    f->minLon = floor(west / cellDegrees);
+    f->maxLon = floor(east / cellDegrees);
+    if (west < -180 || east > 180 || south < -90 || north > 90 ||
+            (int64_t)(f->maxLat - f->minLat + 1) * (f->maxLon - f->minLon + 1) > GEOFENCE_MAX_CELLS) {
+        f->minLat = INT32_MIN;
+        return cell_add(GEOFENCE_ALWAYS, 0, 0, index);
+    }
+    for (lat = f->minLat; lat <= f->maxLat; lat++) {
+        for (lon = f->minLon; lon <= f->maxLon; lon++) {
+            if (cell_add(bucket_of(lat, lon), lat, lon, index)) {
+                fence_unindex(index);
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+static int fence_find(int32_t id) {
+    int i;
+
+    for (i = 0; i < fenceCount; i++)
+        if (fences[i].used && fences[i].id == id)
+            return i;
+    return -1;
+}
+
+/* New, unindexed fence slot, or -1 */
+static int fence_alloc(int32_t id, int monitor, uint32_t dwell) {
+    Geofence *p;
+    int i;
+
+    if (fence_find(id) >= 0)
+        return -1;
+    if (fenceFree >= 0) {
+        i = fenceFree;
+        fenceFree = fences[i].insidePos;
+    } else {
+        if (fenceCount == fenceCapacity) {
+            p = grow(fences, &fenceCapacity, sizeof(Geofence));
+            if (p == NULL)
+                return -1;
+            fences = p;
+        }
+        i = fenceCount++;
+    }
+    memset(&fences[i], 0, sizeof(Geofence));
+    fences[i].id = id;
+    fences[i].used = 1;
+    fences[i].monitor = monitor;
+    fences[i].dwell = dwell;
+    fences[i].round = updateRound;
+    return i;
+}
+
+static void fence_release(int index) {
+    free(fences[index].vertices);
+    fences[index].vertices = NULL;
+    fences[index].used = 0;
+    fences[index].insidePos = fenceFree;
+    fenceFree = index;
+}
+
+void geofence_init(double cell_m) {
+    int i;
+
+    geofence_cleanup();
+    pthread_mutex_lock(&geofenceLock);
+    cellDegrees = (cell_m > 10 ? cell_m : 10) / METERS_PER_DEGREE;
+    for (i = 0; i <= GEOFENCE_BUCKETS; i++)
+        buckets[i] = -1;
+    pthread_mutex_unlock(&geofenceLock);
+}
+
+void geofence_cleanup() {
+    int i;
+
+    pthread_mutex_lock(&geofenceLock);
+    if (fixesTested)
+        LOGI("Geofencing: %u fixes tested against %llu fences, %u transitions",
+             fixesTested, (unsigned long long)fencesTested, transitions);
+    for (i = 0; i < fenceCount; i++)
+        free(fences[i].vertices);
+    free(fences);
+    free(cells);
+    free(insideList);
+    fences = NULL;
+    cells = NULL;
+    insideList = NULL;
+    fenceCount = fenceCapacity = cellCapacity = cellUsed = insideCount = insideCapacity = 0;
+    fenceFree = cellFree = -1;
+    for (i = 0; i <= GEOFENCE_BUCKETS; i++)
+        buckets[i] = -1;
+    fixesTested = transitions = 0;
+    fencesTested = 0;
+    pthread_mutex_unlock(&geofenceLock);
+}
+
+int geofence_add_circle(int32_t id, double latitude, double longitude, double radius_m,
+                        int monitor, uint32_t dwell_ms) {
+    double dlat, dlon;
+    Geofence *f;
+    int i, ret = -1;
+
+    if (radius_m <= 0 || latitude < -90 || latitude > 90)
+        return -1;
+    pthread_mutex_lock(&geofenceLock);
+    i = fence_alloc(id, monitor, dwell_ms);
+    if (i >= 0) {
+        f = &fences[i];
+        f->latitude = latitude;
+        f->longitude = longitude;
+        f->cosLatitude = cos(latitude * M_PI / 180);
+        f->radius = radius_m;
+        dlat = (radius_m + GEOFENCE_MAX_MARGIN) / METERS_PER_DEGREE;
+        dlon = f->cosLatitude > 0.01 ? dlat / f->cosLatitude : 360;
+        ret = fence_index(i, latitude - dlat, latitude + dlat, longitude - dlon, longitude + dlon);
+        if (ret)
+            fence_release(i);
+    }
+    pthread_mutex_unlock(&geofenceLock);
+    return ret;
+}
+
+int geofence_add_polygon(int32_t id, const double *vertices, int count, int monitor,
+                         uint32_t dwell_ms) {
+    double south = 90, north = -90, west = 180, east = -180, margin;
+    Geofence *f;
+    int i, v, ret = -1;
+
+    if (count < 3)
+        return -1;
+    pthread_mutex_lock(&geofenceLock);
+    i = fence_alloc(id, monitor, dwell_ms);
+    if (i < 0)
+        goto out;
+    f = &fences[i];
+    f->vertices = malloc(count * 2 * sizeof(float));
+    if (f->vertices == NULL) {
+        fence_release(i);
+        goto out;
+    }
+    f->count = count;
+    f->latitude = vertices[0];
+    f->longitude = vertices[1];
+    f->cosLatitude = cos(f->latitude * M_PI / 180);
+    for (v = 0; v < count; v++) {
+        f->vertices[2 * v] = lon_delta(vertices[2 * v + 1], f->longitude) * f->cosLatitude *
+                             METERS_PER_DEGREE;
+        f->vertices[2 * v + 1] = (vertices[2 * v] - f->latitude) * METERS_PER_DEGREE;
+        if (vertices[2 * v] < south)
+            south = vertices[2 * v];
+        if (vertices[2 * v] > north)
+            north = vertices[2 * v];
+        if (vertices[2 * v + 1] < west)
+            west = vertices[2 * v + 1];
+        if (vertices[2 * v + 1] > east)
+            east = vertices[2 * v + 1];
+    }
+    margin = GEOFENCE_MAX_MARGIN / METERS_PER_DEGREE;
+    /* Polygons spanning more than half the globe in longitude are taken to cross the antimeridian */
+    if (east - west > 180)
+        west = -181;
+    ret = fence_index(i, south - margin, north + margin, west - margin / f->cosLatitude,
+                      east + margin / f->cosLatitude);
+    if (ret)
+        fence_release(i);
+out:
+    pthread_mutex_unlock(&geofenceLock);
+    return ret;
+}
+
+static void inside_remove(Geofence *f) {
+    int last = insideList[--insideCount];
+
+    insideList[f->insidePos] = last;
+    fences[last].insidePos = f->insidePos;
+    f->inside = 0;
+}
+
+int geofence_remove(int32_t id) {
+    int i;
+
+    pthread_mutex_lock(&geofenceLock);
+    i = fence_find(id);
+    if (i >= 0) {
+        if (fences[i].inside)
+            inside_remove(&fences[i]);
+        fence_unindex(i);
+        fence_release(i);
+    }
+    pthread_mutex_unlock(&geofenceLock);
+    return i >= 0 ? 0 : -1;
+}
+
+static double segment_distance(float px, float py, const float *a, const float *b) {
+    double dx = b[0] - a[0], dy = b[1] - a[1], t = 0, ex, ey;
+    double length = dx * dx + dy * dy;
+
+    if (length > 0) {
+        t = ((px - a[0]) * dx + (py - a[1]) * dy) / length;
+        t = t < 0 ? 0 : t > 1 ? 1 : t;
+    }
+    ex = a[0] + t * dx - px;
+    ey = a[1] + t * dy - py;
+    return sqrt(ex * ex + ey * ey);
+}
+
+/* Is the point inside f, or within margin meters of it? */
+static int fence_contains(const Geofence *f, double latitude, double longitude, double margin) {
+    double x = lon_delta(longitude, f->longitude) * f->cosLatitude * METERS_PER_DEGREE;
+    double y = (latitude - f->latitude) * METERS_PER_DEGREE;
+    const float *a, *b;
+    int i, inside = 0;
+
+    if (!f->count)
+        return x * x + y * y <= (f->radius + margin) * (f->radius + margin);
+
+    for (i = 0, b = &f->vertices[2 * (f->count - 1)]; i < f->count; i++, b = a) {
+        a = &f->vertices[2 * i];
+        if ((a[1] > y) != (b[1] > y) && x < (b[0] - a[0]) * (y - a[1]) / (b[1] - a[1]) + a[0])
+            inside = !inside;
+    }
+    if (inside || margin <= 0)
+        return inside;
+    for (i = 0, b = &f->vertices[2 * (f->count - 1)]; i < f->count; i++, b = a) {
+        a = &f->vertices[2 * i];
+        if (segment_distance(x, y, a, b) <= margin)
+            return 1;
+    }
+    return 0;
+}
+
+static void fence_test(int index, const GpsLocation *location, double margin,
+                       GeofenceTransition transition) {
+    Geofence *f = &fences[index];
+    int *p;
+
+    f->round = updateRound;
+    fencesTested++;
+    if (!fence_contains(f, location->latitude, location->longitude, f->inside ? margin : 0)) {
+        if (f->inside) {
+            inside_remove(f);
+            if (f->monitor & GPS_SHIM_GEOFENCE_EXITED) {
+                transitions++;
+                transition(f->id, GPS_SHIM_GEOFENCE_EXITED, location);
+            }
+        }
+        return;
+    }
+
+    if (!f->inside) {
+        if (insideCount == insideCapacity) {
+            p = grow(insideList, &insideCapacity, sizeof(int));
+            if (p == NULL)
+                return;
+            insideList = p;
+        }
+        f->inside = 1;
+        f->insidePos = insideCount;
+        insideList[insideCount++] = index;
+        f->entered = location->timestamp;
+        f->dwelled = 0;
+        if (f->monitor & GPS_SHIM_GEOFENCE_ENTERED) {
+            transitions++;
+            transition(f->id, GPS_SHIM_GEOFENCE_ENTERED, location);
+        }
+    } else if ((f->monitor & GPS_SHIM_GEOFENCE_DWELL) && !f->dwelled &&
+               location->timestamp - f->entered >= f->dwell) {
+        f->dwelled = 1;
+        transitions++;
+        transition(f->id, GPS_SHIM_GEOFENCE_DWELL, location);
+    }
+}
+
+int geofence_update(const GpsLocation *location, GeofenceTransition transition) {
+    int32_t lat, lon;
+    double margin = 0;
+    uint64_t tested;
+    int i;
+
+    if (!(location->flags & GPS_LOCATION_HAS_LAT_LONG))
+        return 0;
+    pthread_mutex_lock(&geofenceLock);
+    if (fenceCount == 0) {
+        pthread_mutex_unlock(&geofenceLock);
+        return 0;
+    }
+    if (location->flags & GPS_LOCATION_HAS_ACCURACY)
+        margin = location->accuracy < GEOFENCE_MAX_MARGIN ? location->accuracy : GEOFENCE_MAX_MARGIN;
+    updateRound++;
+    fixesTested++;
+    tested = fencesTested;
+
+    lat = floor(location->latitude / cellDegrees);
+    lon = floor(location->longitude / cellDegrees);
+    for (i = buckets[bucket_of(lat, lon)]; i >= 0; i = cells[i].next)
+        if (cells[i].lat == lat && cells[i].lon == lon)
+            fence_test(cells[i].fence, location, margin, transition);
+    for (i = buckets[GEOFENCE_ALWAYS]; i >= 0; i = cells[i].next)
+        fence_test(cells[i].fence, location, margin, transition);
+
+    /* Fences we are in but whose cells the fix has left: definitely outside now */
+    for (i = insideCount - 1; i >= 0; i--) {
+        Geofence *f = &fences[insideList[i]];
+        if (f->round == updateRound)
+            continue;
+        inside_remove(f);
+        if (f->monitor & GPS_SHIM_GEOFENCE_EXITED) {
+            transitions++;
+            transition(f->id, GPS_SHIM_GEOFENCE_EXITED, location);
+        }
+    }
+    tested = fencesTested - tested;
+    pthread_mutex_unlock(&geofenceLock);
+    return tested;
+}
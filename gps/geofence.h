@@ -0,0 +1,59 @@
+/******************************************************************************
+ * GPS HAL shim - geofencing
+ *
+ * Copyright (C) 2012, rondoval
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ ******************************************************************************/
+
+
+#ifndef GPSSHIM_GEOFENCE_H
+#define GPSSHIM_GEOFENCE_H
+
+#include <stdint.h>
+#include <hardware/gps.h>
+
+/*
+ * Circle and polygon fences tested against every fix. Fences are indexed in
+ * a hashed uniform grid of cell_m sided cells, each fence listed in every
+ * cell its bounding box (grown by the exit margin) overlaps, so a fix is
+ * only tested against the fences of its own cell and those it is inside.
+ * Fences too large for the grid, or across the antimeridian, are tested
+ * against every fix.
+ *
+ * To keep a fix jittering on the boundary from flapping, a fence is only
+ * left once the fix is outside by more than its accuracy (50m at most).
+ * Dwell is measured with fix timestamps.
+ *
+ * All functions are thread safe.
+ */
+typedef void (*GeofenceTransition)(int32_t id, int32_t transition, const GpsLocation *location);
+
+/* Drop every fence and start over with the given cell size */
+void geofence_init(double cell_m);
+void geofence_cleanup();
+
+int geofence_add_circle(int32_t id, double latitude, double longitude, double radius_m,
+                        int monitor, uint32_t dwell_ms);
+int geofence_add_polygon(int32_t id, const double *vertices, int count, int monitor,
+                         uint32_t dwell_ms);
+int geofence_remove(int32_t id);
+
+/*
+ * Test a fix against the fences, calling transition for each transition
+ * being monitored. Returns the number of fences tested.
+ */
+int geofence_update(const GpsLocation *location, GeofenceTransition transition);
+
+#endif
@@ -22,11 +22,35 @@
 
 //#define LOG_NDEBUG 0
 
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#ifdef HAVE_ANDROID_OS
+#include <linux/android_alarm.h>
+#endif
 #define LOG_TAG "gps-shim"
 #include <utils/Log.h>
+#include <cutils/atomic.h>
+#include <cutils/atomic-inline.h>
+#include <cutils/properties.h>
 
 #include <gpsshim.h>
+#include "nmea.h"
+#include "feed.h"
+#include "geofence.h"
+#include "persist.h"
+#include "policy.h"
+#include "trace.h"
+#include "xtra_cache.h"
 
 
 GpsCallbacks *originalCallbacks;
@@ -42,11 +66,1500 @@ static GpsNiInterface newNI;
 static const OldGpsInterface* originalGpsInterface = NULL;
 static GpsInterface newGpsInterface;
 
+#ifndef GPS_LIBRARIES
 extern const OldGpsInterface* gps_get_hardware_interface();
+#endif
 
+static OldAGpsCallbacks oldAGpsCallbacks;
+static const AGpsCallbacks* newAGpsCallbacks = NULL;
+static OldAGpsRilCallbacks oldAGpsRilCallbacks;
+static const AGpsRilCallbacks* newAGpsRilCallbacks = NULL;
+static OldGpsXtraCallbacks oldXtraCallbacks;
+static const GpsXtraCallbacks* newXtraCallbacks = NULL;
+static const GpsShimGeofenceCallbacks* geofenceCallbacks = NULL;
+static GpsNiCallbacks oldNiCallbacks;
+static const GpsNiCallbacks* newNiCallbacks = NULL;
 
-static void location_callback_wrapper(OldGpsLocation *location) {
-    static GpsLocation newLocation;
+/* Event dispatcher
+ *
+ * The legacy library calls us on its own threads, which are not attached to
+ * the VM. Rather than creating a VM-attached thread for every single event,
+ * callbacks are translated, queued, and delivered in order by one long-lived
+ * thread created through create_thread_cb when the shim is initialized.
+ *
+ * Events live in preallocated rings of slots, each slot owning a copy of its
+ * payload, so nothing is allocated on the legacy callback path and the
+ * legacy library is free to reuse its buffers as soon as we return. The core
+ * and NMEA rings are single-producer/single-consumer and lock-free: only the
+ * legacy GPS callbacks write to them. Nothing promises that those all come
+ * from one thread (status_cb is often called from within start() or
+ * stop()), so the location, status, SV status and NMEA callbacks are
+ * serialized by callbackLock, which also covers the rest of the state
+ * marked "legacy callback thread" below; it is uncontended when the library
+ * sticks to one thread. NI notifications, AGPS and AGPS
+ * RIL requests, and XTRA requests can come from
+ * assorted threads, so their three (rarely used) rings serialize producers,
+ * each with its own lock.
+ * Every published event posts the dispatcher's semaphore once.
+ *
+ * When the framework is slow, events are delivered by priority and each kind
+ * has its own backlog policy, so that positions stay fresh:
+ *
+ *  - NI notifications go out first: the user has to answer them before the
+ *    network's timeout runs out;
+ *  - AGPS status and AGPS RIL setid/refloc requests come next: the SUPL
+ *    session that gets us our first fix waits on the framework's answer;
+ *  - then fixes, status, geofence transitions and batch flushes, which
+ *    share the core ring, large enough for minutes of backlog. Its last
+ *    SHIM_CORE_RESERVED slots are off limits to fixes, so status and
+ *    geofence transitions always find room behind a fix backlog. Fixes that
+ *    don't fit are parked in the fix batch ring, in order, and handed over
+ *    as one flush once there is room again (see overflow_flush()); only
+ *    when that fills up too are fixes dropped;
+ *  - XTRA download requests come next;
+ *  - SV status is latest-only: a report the dispatcher has not got to yet is
+ *    replaced by the next one;
+ *  - NMEA goes last, into a ring of its own, and is the first to be dropped.
+ */
+#define SHIM_NI_SLOTS       4       /* power of two */
+#define SHIM_AGPS_SLOTS     16      /* power of two */
+#define SHIM_CORE_SLOTS     256     /* power of two */
+#define SHIM_CORE_RESERVED  32      /* of which fixes can't use */
+#define SHIM_AUX_SLOTS      8       /* power of two */
+#define SHIM_NMEA_SLOTS     32      /* power of two */
+#define SHIM_NMEA_MAX       1024    /* room for a whole batched epoch */
+
+enum {
+    SHIM_EVENT_LOCATION,
+    SHIM_EVENT_STATUS,
+    SHIM_EVENT_SV_STATUS,
+    SHIM_EVENT_NMEA,
+    SHIM_EVENT_AGPS_STATUS,
+    SHIM_EVENT_AGPSRIL_SETID,
+    SHIM_EVENT_AGPSRIL_REFLOC,
+    SHIM_EVENT_XTRA_DOWNLOAD,
+    SHIM_EVENT_FIX_BATCH,
+    SHIM_EVENT_GEOFENCE,
+    SHIM_EVENT_NI_NOTIFY,
+    SHIM_EVENT_TYPES
+};
+
+typedef struct {
+    int type;
+    int64_t queued;                 /* ns, set when published */
+    union {
+        GpsLocation location;
+        GpsStatus status;
+        GpsSvStatus sv_status;
+        AGpsStatus agps_status;
+        uint32_t agpsril_flags;
+        int32_t batch_end;          /* deliver parked fixes up to here */
+        struct {
+            int32_t id;
+            int32_t transition;
+            GpsLocation location;
+        } geofence;
+        struct {
+            GpsUtcTime timestamp;
+            int length;
+        } nmea;
+    } u;
+} ShimEvent;
+
+/* The larger payloads stay out of the core slots */
+typedef struct {
+    ShimEvent event;
+    char sentence[SHIM_NMEA_MAX];
+} ShimNmeaEvent;
+
+typedef struct {
+    ShimEvent event;
+    GpsSvStatus sv_status;
+} ShimSvEvent;
+
+typedef struct {
+    ShimEvent event;
+    GpsNiNotification notification;
+} ShimNiEvent;
+
+#define NMEA_SENTENCE(e)    (((ShimNmeaEvent *)(e))->sentence)
+#define SV_STATUS(e)        (&((ShimSvEvent *)(e))->sv_status)
+#define NI_NOTIFICATION(e)  (&((ShimNiEvent *)(e))->notification)
+
+typedef struct {
+    const char *name;
+    char *slots;
+    size_t slotSize;
+    int32_t mask;
+    volatile int32_t head;          /* next slot to fill, written by the producer */
+    volatile int32_t tail;          /* next slot to deliver, written by the dispatcher */
+    pthread_mutex_t *producerLock;  /* NULL if producers are serialized by callbackLock */
+    uint32_t dropped;
+    int32_t highWater;              /* deepest the ring has been */
+} ShimRing;
+
+static ShimNiEvent niSlots[SHIM_NI_SLOTS];
+static ShimEvent agpsSlots[SHIM_AGPS_SLOTS];
+static ShimEvent coreSlots[SHIM_CORE_SLOTS];
+static ShimEvent auxSlots[SHIM_AUX_SLOTS];
+static ShimNmeaEvent nmeaSlots[SHIM_NMEA_SLOTS];
+static pthread_mutex_t callbackLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t niLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t agpsLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t auxLock = PTHREAD_MUTEX_INITIALIZER;
+static ShimRing niRing = { "ni", (char *)niSlots, sizeof(ShimNiEvent), SHIM_NI_SLOTS - 1,
+                           0, 0, &niLock, 0, 0 };
+static ShimRing agpsRing = { "agps", (char *)agpsSlots, sizeof(ShimEvent), SHIM_AGPS_SLOTS - 1,
+                             0, 0, &agpsLock, 0, 0 };
+static ShimRing coreRing = { "core", (char *)coreSlots, sizeof(ShimEvent), SHIM_CORE_SLOTS - 1,
+                             0, 0, NULL, 0, 0 };
+static ShimRing auxRing = { "aux", (char *)auxSlots, sizeof(ShimEvent), SHIM_AUX_SLOTS - 1,
+                            0, 0, &auxLock, 0, 0 };
+static ShimRing nmeaRing = { "nmea", (char *)nmeaSlots, sizeof(ShimNmeaEvent), SHIM_NMEA_SLOTS - 1,
+                             0, 0, NULL, 0, 0 };
+
+/*
+ * Latest-only slot: a triple buffer between one producer and the
+ * dispatcher. The producer fills its back buffer and swaps it with the
+ * middle one, flagging it fresh; the dispatcher swaps its front buffer with
+ * a fresh middle one. Neither ever waits, and an unread value is replaced.
+ */
+#define LATEST_FRESH    4
+
+typedef struct {
+    char *buffers;
+    size_t size;
+    int back;                       /* producer's */
+    int front;                      /* dispatcher's */
+    volatile int32_t middle;        /* index, | LATEST_FRESH when unread */
+    uint32_t replaced;
+} ShimLatest;
+
+static ShimSvEvent svBuffers[3];
+static ShimLatest svLatest = { (char *)svBuffers, sizeof(ShimSvEvent), 0, 2, 1, 0 };
+
+/* Instrumentation
+ *
+ * Per event type: events queued, dropped because their ring was full, and
+ * delivered, with a histogram of the time from event_publish() to the
+ * framework callback in power of two microsecond buckets. Per ring: the
+ * high-water mark of its depth. The cost is one clock read on each side of
+ * the queue; producers count with atomic increments as fix batch flushes
+ * may be queued from any thread, the dispatcher alone writes the rest.
+ * NI notifications get one more histogram, of the time from the legacy
+ * library's notification to the user's answer coming back through
+ * respond(); it is written under niLock.
+ *
+ * The numbers are read through the gpsshim-stats extension, or written to
+ * persist.gpsshim.stats_file (empty by default) every
+ * persist.gpsshim.stats_ms (60s by default) by the dispatcher, only while
+ * it is awake delivering events anyway, and when it stops.
+ */
+#define SHIM_LATENCY_BUCKETS    20  /* <1us, <2us ... <2^18us, longer */
+
+typedef struct {
+    volatile int32_t queued;
+    volatile int32_t dropped;
+    uint32_t delivered;
+    uint32_t latency[SHIM_LATENCY_BUCKETS];
+    int64_t latencySum;             /* us */
+    uint32_t latencyMax;            /* us */
+} ShimEventStats;
+
+static const char *eventNames[SHIM_EVENT_TYPES] = {
+    "location", "status", "sv status", "nmea", "agps status",
+    "agpsril setid", "agpsril refloc", "xtra download", "fix batch", "geofence",
+    "ni notify",
+};
+static ShimEventStats eventStats[SHIM_EVENT_TYPES];
+static ShimEventStats niResponseStats;
+static char statsPath[PROPERTY_VALUE_MAX];
+static int statsInterval = 60000;
+static int64_t statsWritten = 0;
+
+static sem_t dispatcherWakeup;
+static volatile int32_t dispatcherQuit = 0;
+static int dispatcherRunning = 0;
+/*
+ * create_thread_cb threads are detached Java threads and can't be joined;
+ * the dispatcher reports its exit through dispatcherExited instead
+ */
+static pthread_mutex_t dispatcherExitLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t dispatcherExitCond = PTHREAD_COND_INITIALIZER;
+static int dispatcherExited = 0;
+static uint32_t nmeaTruncated = 0;
+
+/* NMEA batching, see nmea_batch_append(). Types that may legitimately show up more than once per epoch */
+#define NMEA_TYPES_REPEATABLE (NMEA_TYPE_GSV | NMEA_TYPE_OTHER)
+
+static int nmeaBatching = 0;
+static ShimEvent *nmeaBatch = NULL;     /* reserved in nmeaRing, not yet published */
+static uint32_t nmeaBatchTypes = 0;
+static uint32_t nmeaSentences = 0;
+static uint32_t nmeaBatches = 0;
+
+/*
+ * Every sentence goes through nmea_parse() on the legacy callback thread.
+ * With persist.gpsshim.nmea_check (on by default) malformed sentences are
+ * dropped there. The latest GGA and RMC are kept to complete fixes the
+ * legacy library reports without altitude, speed or bearing, and every
+ * parsed sentence goes to the feed next to the raw one (see feed.h).
+ */
+static int nmeaCheck = 1;
+static uint32_t nmeaMalformed = 0;
+static uint32_t locationsCompleted = 0;
+static NmeaSentence nmeaParsed;
+static NmeaSentence nmeaLastGga;
+static NmeaSentence nmeaLastRmc;
+
+static int64_t now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* Vendor library
+ *
+ * The framework gets the GPS interface while system_server boots, location
+ * enabled or not, but only initializes it once location is turned on. So
+ * rather than linking against the legacy library (GPS_LIBRARIES, from
+ * BOARD_GPS_LIBRARIES), it is dlopen()ed by the first init or the first call
+ * into one of its extensions, and boot does not pay for loading and
+ * relocating it and its dependencies, nor for their memory while GPS stays
+ * idle. The framework asks for every extension at boot too, so those are
+ * handed out by the shim without loading anything (see
+ * wrapper_get_extension()). With persist.gpsshim.preload=1 the library is
+ * loaded by a background thread as soon as the interface is handed out
+ * instead. A load that failed is tried again on the next call.
+ * Builds without GPS_LIBRARIES, like the host benchmark, link it directly.
+ */
+#define LEGACY_MAX_LIBRARIES    8
+
+static pthread_mutex_t legacyLock = PTHREAD_MUTEX_INITIALIZER;
+static int64_t legacyLoadTime = -1;         /* us */
+static int legacyPreload = 0;
+
+/* legacyLock held */
+static void legacy_load_locked() {
+    int64_t begin = now_ns();
+#ifdef GPS_LIBRARIES
+    const OldGpsInterface* (*get_interface)() = NULL;
+    char libraries[] = GPS_LIBRARIES, path[128], *name, *next;
+    void *handles[LEGACY_MAX_LIBRARIES];
+    int count = 0;
+
+    for (name = strtok_r(libraries, " ", &next); name; name = strtok_r(NULL, " ", &next)) {
+        snprintf(path, sizeof(path), "%s.so", name);
+        if (count == LEGACY_MAX_LIBRARIES) {
+            LOGE("Too many legacy GPS libraries, not loading %s", path);
+            goto fail;
+        }
+        handles[count] = dlopen(path, RTLD_NOW | RTLD_GLOBAL);
+        if (handles[count] == NULL) {
+            LOGE("Could not load %s: %s", path, dlerror());
+            goto fail;
+        }
+        if (get_interface == NULL)
+            get_interface = (const OldGpsInterface* (*)())dlsym(handles[count],
+                                                                "gps_get_hardware_interface");
+        count++;
+    }
+    if (get_interface == NULL) {
+        LOGE("No gps_get_hardware_interface in %s", GPS_LIBRARIES);
+        goto fail;
+    }
+    originalGpsInterface = get_interface();
+    if (originalGpsInterface == NULL) {
+        LOGE("gps_get_hardware_interface returned no interface");
+        goto fail;
+    }
+#else
+    originalGpsInterface = gps_get_hardware_interface();
+    if (originalGpsInterface == NULL)
+        return;
+#endif
+    oldXTRA = originalGpsInterface->get_extension(GPS_XTRA_INTERFACE);
+    oldAGPS = originalGpsInterface->get_extension(AGPS_INTERFACE);
+    oldAGPSRIL = originalGpsInterface->get_extension(AGPS_RIL_INTERFACE);
+    oldNI = originalGpsInterface->get_extension(GPS_NI_INTERFACE);
+    legacyLoadTime = (now_ns() - begin) / 1000;
+    LOGI("Legacy GPS library %s in %lld us", legacyPreload ? "preloaded" : "loaded",
+         (long long)legacyLoadTime);
+    return;
+
+#ifdef GPS_LIBRARIES
+fail:
+    /* Unload in reverse, so the next try starts from scratch */
+    while (count > 0)
+        dlclose(handles[--count]);
+#endif
+}
+
+/* Load the legacy library if needed, returns 0 once its interface is there */
+static int legacy_load() {
+    int ret;
+
+    pthread_mutex_lock(&legacyLock);
+    if (originalGpsInterface == NULL)
+        legacy_load_locked();
+    ret = originalGpsInterface == NULL ? -1 : 0;
+    pthread_mutex_unlock(&legacyLock);
+    return ret;
+}
+
+static void* legacy_preload(void *unused) {
+    legacy_load();
+    return NULL;
+}
+
+/* Fix batching
+ *
+ * While batching is on (persist.gpsshim.fix_batch=<fixes>, optionally with
+ * persist.gpsshim.fix_batch_ms=<max age>, or through the gpsshim-batching
+ * extension), translated fixes are parked in a bounded ring of their own
+ * instead of being queued one by one. A flush event queued behind them makes
+ * the dispatcher deliver everything parked up to that point in one burst.
+ * Fixes are flushed when max_fixes are parked, when the oldest one is older
+ * than max_age_ms as a new one arrives, on an explicit flush, when batching
+ * is turned off, and when the session stops.
+ *
+ * Parked fixes do not wake the dispatcher, so the wakelock it holds while
+ * delivering (see dispatcher_wait()) is only taken for each flush.
+ *
+ * The ring is single-producer/single-consumer like coreRing. Flushes go
+ * through coreRing too, also when requested from other threads, so that a
+ * fix queued after a flush can never overtake the fixes it flushed.
+ */
+#define SHIM_BATCH_SLOTS    128     /* power of two */
+
+static GpsLocation batchSlots[SHIM_BATCH_SLOTS];
+static volatile int32_t batchHead = 0;      /* written by the legacy callback thread */
+static volatile int32_t batchTail = 0;      /* written by the dispatcher */
+static volatile int32_t batchFlushed = 0;   /* batchHead at the last flush */
+static volatile int32_t batchMaxFixes = 0;  /* 0 when batching is off */
+static volatile int32_t batchMaxAge = 0;
+static int64_t batchOldest = 0;
+static uint32_t batchFlushes = 0;
+static uint32_t batchDropped = 0;
+static int overflowPending = 0;             /* fixes are parked on core overflow, see overflow_flush() */
+static uint32_t overflowParked = 0;
+
+/* Dispatcher: deliver parked fixes up to end */
+static void batch_deliver(int32_t end) {
+    int32_t tail = batchTail;
+
+    while (end - tail > 0) {
+        originalCallbacks->location_cb(&batchSlots[tail & (SHIM_BATCH_SLOTS - 1)]);
+        android_atomic_release_store(++tail, &batchTail);
+    }
+}
+
+static ShimEvent* ring_slot(ShimRing *ring, int32_t index) {
+    return (ShimEvent *)(ring->slots + (index & ring->mask) * ring->slotSize);
+}
+
+/* Producer side, single producer rings only: events not delivered yet */
+static int32_t ring_depth(ShimRing *ring) {
+    return ring->head - android_atomic_acquire_load(&ring->tail);
+}
+
+/* Producer side: grab the next free slot, or NULL if the ring is full */
+static ShimEvent* event_reserve(ShimRing *ring, int type) {
+    ShimEvent *event;
+
+    if (ring->producerLock)
+        pthread_mutex_lock(ring->producerLock);
+    if (ring->head - android_atomic_acquire_load(&ring->tail) > ring->mask) {
+        /* Log the first drop and then every power of two, never silently */
+        ring->dropped++;
+        android_atomic_inc(&eventStats[type].dropped);
+        if ((ring->dropped & (ring->dropped - 1)) == 0)
+            LOGW("%s ring full, dropped event %d (%u so far)", ring->name, type, ring->dropped);
+        if (ring->producerLock)
+            pthread_mutex_unlock(ring->producerLock);
+        return NULL;
+    }
+    event = ring_slot(ring, ring->head);
+    event->type = type;
+    return event;
+}
+
+/* Producer side: hand the slot returned by event_reserve() to the dispatcher */
+static void event_publish(ShimRing *ring) {
+    ShimEvent *event = ring_slot(ring, ring->head);
+    int32_t depth = ring->head + 1 - android_atomic_acquire_load(&ring->tail);
+
+    event->queued = now_ns();
+    android_atomic_inc(&eventStats[event->type].queued);
+    if (depth > ring->highWater)
+        ring->highWater = depth;
+    android_atomic_release_store(ring->head + 1, &ring->head);
+    if (ring->producerLock)
+        pthread_mutex_unlock(ring->producerLock);
+    sem_post(&dispatcherWakeup);
+}
+
+static ShimEvent* ring_peek(ShimRing *ring) {
+    if (ring->tail == android_atomic_acquire_load(&ring->head))
+        return NULL;
+    return ring_slot(ring, ring->tail);
+}
+
+static void ring_release(ShimRing *ring) {
+    android_atomic_release_store(ring->tail + 1, &ring->tail);
+}
+
+static ShimEvent* latest_buffer(ShimLatest *latest, int index) {
+    return (ShimEvent *)(latest->buffers + index * latest->size);
+}
+
+/* Producer side: the buffer to fill before latest_publish() */
+static ShimEvent* latest_back(ShimLatest *latest, int type) {
+    ShimEvent *event = latest_buffer(latest, latest->back);
+
+    event->type = type;
+    return event;
+}
+
+static void latest_publish(ShimLatest *latest) {
+    ShimEvent *event = latest_buffer(latest, latest->back);
+    int32_t old;
+
+    event->queued = now_ns();
+    android_atomic_inc(&eventStats[event->type].queued);
+    android_memory_barrier();
+    do {
+        old = latest->middle;
+    } while (android_atomic_release_cas(old, latest->back | LATEST_FRESH, &latest->middle));
+    latest->back = old & ~LATEST_FRESH;
+    if (old & LATEST_FRESH) {
+        latest->replaced++;
+        android_atomic_inc(&eventStats[event->type].dropped);
+    }
+    sem_post(&dispatcherWakeup);
+}
+
+/* Dispatcher: the latest value if it was not taken yet, else NULL */
+static ShimEvent* latest_take(ShimLatest *latest) {
+    int32_t old;
+
+    do {
+        old = latest->middle;
+        if (!(old & LATEST_FRESH))
+            return NULL;
+    } while (android_atomic_acquire_cas(old, latest->front, &latest->middle));
+    android_memory_barrier();
+    latest->front = old & ~LATEST_FRESH;
+    return latest_buffer(latest, latest->front);
+}
+
+static void stats_account(ShimEventStats *stats, int64_t latency) {
+    int bucket = 0;
+
+    while (bucket < SHIM_LATENCY_BUCKETS - 1 && latency >= (1 << bucket))
+        bucket++;
+    stats->latency[bucket]++;
+    stats->latencySum += latency;
+    if (latency > stats->latencyMax)
+        stats->latencyMax = latency;
+    stats->delivered++;
+}
+
+/* Dispatcher: account for an event about to be delivered */
+static void event_account(const ShimEvent *event) {
+    stats_account(&eventStats[event->type], (now_ns() - event->queued) / 1000);
+}
+
+static void event_deliver(ShimEvent *event) {
+    event_account(event);
+    switch (event->type) {
+    case SHIM_EVENT_LOCATION:
+        originalCallbacks->location_cb(&event->u.location);
+        break;
+    case SHIM_EVENT_STATUS:
+        originalCallbacks->status_cb(&event->u.status);
+        break;
+    case SHIM_EVENT_SV_STATUS:
+        originalCallbacks->sv_status_cb(SV_STATUS(event));
+        break;
+    case SHIM_EVENT_NMEA:
+        originalCallbacks->nmea_cb(event->u.nmea.timestamp, NMEA_SENTENCE(event), event->u.nmea.length);
+        break;
+    case SHIM_EVENT_AGPS_STATUS:
+        newAGpsCallbacks->status_cb(&event->u.agps_status);
+        break;
+    case SHIM_EVENT_AGPSRIL_SETID:
+        newAGpsRilCallbacks->request_setid(event->u.agpsril_flags);
+        break;
+    case SHIM_EVENT_AGPSRIL_REFLOC:
+        newAGpsRilCallbacks->request_refloc(event->u.agpsril_flags);
+        break;
+    case SHIM_EVENT_XTRA_DOWNLOAD:
+        newXtraCallbacks->download_request_cb();
+        break;
+    case SHIM_EVENT_FIX_BATCH:
+        batch_deliver(event->u.batch_end);
+        break;
+    case SHIM_EVENT_GEOFENCE:
+        geofenceCallbacks->transition_cb(event->u.geofence.id, &event->u.geofence.location,
+                                         event->u.geofence.transition);
+        break;
+    case SHIM_EVENT_NI_NOTIFY:
+        newNiCallbacks->notify_cb(NI_NOTIFICATION(event));
+        break;
+    }
+}
+
+/*
+ * Wakelock
+ *
+ * Rather than holding the wakelock from start to stop, the dispatcher takes
+ * it when it wakes up to deliver an event and lets go of it once the queues
+ * have stayed empty for persist.gpsshim.wakelock_holdoff_ms (100ms by
+ * default), so that the CPU may sleep between fixes without the wakelock
+ * flapping for every sentence of an epoch. Only the dispatcher touches it.
+ */
+static int wakelockHoldOff = 100;
+static int wakelockHeld = 0;
+static int64_t wakelockSince = 0;
+static uint32_t wakelockAcquisitions = 0;
+static int64_t wakelockHeldTime = 0;
+
+static void wakelock_acquire() {
+    if (wakelockHeld)
+        return;
+    originalCallbacks->acquire_wakelock_cb();
+    wakelockHeld = 1;
+    wakelockSince = now_ms();
+    wakelockAcquisitions++;
+}
+
+static void wakelock_release() {
+    if (!wakelockHeld)
+        return;
+    originalCallbacks->release_wakelock_cb();
+    wakelockHeld = 0;
+    wakelockHeldTime += now_ms() - wakelockSince;
+}
+
+/* Total hold time so far, including the current hold */
+static int64_t wakelock_held_time() {
+    int64_t since = wakelockSince;
+    return wakelockHeldTime + (wakelockHeld ? now_ms() - since : 0);
+}
+
+/* Upper bound in us of the bucket holding the given fraction of the events */
+static int stats_percentile(const ShimEventStats *stats, int percent) {
+    uint32_t seen = 0, wanted = (stats->delivered * (uint64_t)percent + 99) / 100;
+    int bucket;
+
+    for (bucket = 0; bucket < SHIM_LATENCY_BUCKETS - 1; bucket++) {
+        seen += stats->latency[bucket];
+        if (seen >= wanted)
+            break;
+    }
+    return 1 << bucket;
+}
+
+static int stats_dump_row(int fd, const char *name, const ShimEventStats *stats) {
+    char buffer[512];
+    int b, length;
+
+    length = snprintf(buffer, sizeof(buffer), "%-15s %9d %7d %9u %6d %6d %6d %8u\n  histogram",
+                      name, stats->queued, stats->dropped, stats->delivered,
+                      stats_percentile(stats, 50), stats_percentile(stats, 99),
+                      stats->delivered ? (int)(stats->latencySum / stats->delivered) : 0,
+                      stats->latencyMax);
+    for (b = 0; b < SHIM_LATENCY_BUCKETS && length < (int)sizeof(buffer) - 16; b++)
+        length += snprintf(buffer + length, sizeof(buffer) - length, " %u", stats->latency[b]);
+    buffer[length++] = '\n';
+    return write_fully(fd, buffer, length);
+}
+
+/* Write the instrumentation counters to fd as text */
+static int stats_dump(int fd) {
+    char buffer[1024];
+    int i, length;
+
+    length = snprintf(buffer, sizeof(buffer),
+                      "GPS shim events, latency from queued to delivered in us\n"
+                      "%-15s %9s %7s %9s %6s %6s %6s %8s\n", "type", "queued", "dropped",
+                      "delivered", "p50<", "p99<", "mean", "max");
+    if (write_fully(fd, buffer, length))
+        return -1;
+    for (i = 0; i < SHIM_EVENT_TYPES; i++) {
+        if ((eventStats[i].queued || eventStats[i].dropped) &&
+                stats_dump_row(fd, eventNames[i], &eventStats[i]))
+            return -1;
+    }
+    if (niResponseStats.queued || niResponseStats.dropped) {
+        /* queued: notifications, dropped: answers to unknown ones, delivered: answers */
+        length = snprintf(buffer, sizeof(buffer), "NI latency from notification to answer in us\n");
+        if (write_fully(fd, buffer, length) ||
+                stats_dump_row(fd, "ni response", &niResponseStats))
+            return -1;
+    }
+    length = snprintf(buffer, sizeof(buffer),
+                      "ring high-water: ni %d of %d, agps %d of %d, core %d of %d, aux %d of %d, "
+                      "nmea %d of %d\n"
+                      "fixes parked on core overflow %u, sv status replaced %u\n"
+                      "wakelock acquired %u times, held %lld ms\n"
+                      "legacy library %s in %lld us\n",
+                      niRing.highWater, SHIM_NI_SLOTS, agpsRing.highWater, SHIM_AGPS_SLOTS,
+                      coreRing.highWater, SHIM_CORE_SLOTS, auxRing.highWater, SHIM_AUX_SLOTS,
+                      nmeaRing.highWater, SHIM_NMEA_SLOTS, overflowParked, svLatest.replaced,
+                      wakelockAcquisitions, (long long)wakelock_held_time(),
+                      legacyPreload ? "preloaded" : "loaded", (long long)legacyLoadTime);
+    return write_fully(fd, buffer, length);
+}
+
+/* Dispatcher: refresh the stats file if it is due */
+static void stats_write(int force) {
+    int64_t now = now_ms();
+    int fd;
+
+    if (!statsPath[0] || (!force && now - statsWritten < statsInterval))
+        return;
+    statsWritten = now;
+    fd = open(statsPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        LOGW("Could not write %s: %s", statsPath, strerror(errno));
+        statsPath[0] = '\0';
+        return;
+    }
+    stats_dump(fd);
+    close(fd);
+}
+
+/* Wait for the next wakeup, dropping the wakelock once the hold-off expires */
+static void dispatcher_wait() {
+    struct timespec deadline;
+
+    if (!wakelockHeld || sem_trywait(&dispatcherWakeup) == 0) {
+        if (!wakelockHeld)
+            sem_wait(&dispatcherWakeup);
+        return;
+    }
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += wakelockHoldOff / 1000;
+    deadline.tv_nsec += (wakelockHoldOff % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+    while (sem_timedwait(&dispatcherWakeup, &deadline)) {
+        if (errno == ETIMEDOUT) {
+            wakelock_release();
+            sem_wait(&dispatcherWakeup);
+            return;
+        }
+    }
+}
+
+/* Next event by priority; *ring is where to release it, NULL for latest-only slots */
+static ShimEvent* dispatcher_next(ShimRing **ring) {
+    ShimEvent *event;
+
+    if ((event = ring_peek(*ring = &niRing)) != NULL ||
+            (event = ring_peek(*ring = &agpsRing)) != NULL ||
+            (event = ring_peek(*ring = &coreRing)) != NULL ||
+            (event = ring_peek(*ring = &auxRing)) != NULL)
+        return event;
+    *ring = NULL;
+    if ((event = latest_take(&svLatest)) != NULL)
+        return event;
+    return ring_peek(*ring = &nmeaRing);
+}
+
+static void dispatcher_loop(void *unused) {
+    ShimRing *ring;
+    ShimEvent *event;
+
+    LOGV("Dispatcher running");
+    for (;;) {
+        dispatcher_wait();
+
+        /*
+         * At least one wakeup per published event (replaced latest-only
+         * values leave extra ones); a wakeup without an event may be the
+         * quit request
+         */
+        event = dispatcher_next(&ring);
+        if (event == NULL) {
+            if (android_atomic_acquire_load(&dispatcherQuit))
+                break;
+            continue;
+        }
+
+        wakelock_acquire();
+        event_deliver(event);
+        if (ring != NULL)
+            ring_release(ring);
+        stats_write(0);
+    }
+    stats_write(1);
+    wakelock_release();
+    LOGV("Dispatcher exiting");
+
+    /* Last thing: the shim may be torn down as soon as this is seen */
+    pthread_mutex_lock(&dispatcherExitLock);
+    dispatcherExited = 1;
+    pthread_cond_signal(&dispatcherExitCond);
+    pthread_mutex_unlock(&dispatcherExitLock);
+}
+
+static void dispatcher_start() {
+    if (dispatcherRunning)
+        return;
+    sem_init(&dispatcherWakeup, 0, 0);
+    android_atomic_release_store(0, &dispatcherQuit);
+    dispatcherExited = 0;
+    originalCallbacks->create_thread_cb("gpsshim-dispatch", dispatcher_loop, NULL);
+    dispatcherRunning = 1;
+}
+
+static void dispatcher_stop() {
+    if (!dispatcherRunning)
+        return;
+    /* Everything published before this is still delivered */
+    android_atomic_release_store(1, &dispatcherQuit);
+    sem_post(&dispatcherWakeup);
+    pthread_mutex_lock(&dispatcherExitLock);
+    while (!dispatcherExited)
+        pthread_cond_wait(&dispatcherExitCond, &dispatcherExitLock);
+    pthread_mutex_unlock(&dispatcherExitLock);
+    sem_destroy(&dispatcherWakeup);
+    dispatcherRunning = 0;
+    if (niRing.dropped || agpsRing.dropped || coreRing.dropped || auxRing.dropped ||
+            nmeaRing.dropped || nmeaTruncated)
+        LOGW("Dropped %u NI, %u AGPS, %u core, %u aux and %u NMEA events, "
+             "truncated %u NMEA sentences", niRing.dropped, agpsRing.dropped, coreRing.dropped,
+             auxRing.dropped, nmeaRing.dropped, nmeaTruncated);
+    if (overflowParked || svLatest.replaced)
+        LOGI("Parked %u fixes on core ring overflow, replaced %u SV status reports",
+             overflowParked, svLatest.replaced);
+    if (nmeaBatching)
+        LOGI("Delivered %u NMEA sentences in %u batches", nmeaSentences, nmeaBatches);
+    if (batchFlushes || batchDropped)
+        LOGI("Flushed %u fix batches, dropped %u fixes", batchFlushes, batchDropped);
+    LOGI("%u malformed NMEA sentences %s, %u fixes completed from NMEA",
+         nmeaMalformed, nmeaCheck ? "dropped" : "passed on", locationsCompleted);
+}
+
+/* Fix scheduling
+ *
+ * Legacy libraries only take a fix frequency in seconds, and many of them
+ * ignore it. The shim advertises GPS_CAPABILITY_SCHEDULING, so the
+ * framework hands its min_interval, recurrence and preferred accuracy to us
+ * instead of running the engine at 1Hz and filtering itself:
+ *
+ *  - fixes arriving sooner than min_interval after the last delivered one
+ *    are dropped in the shim, so the framework is not woken up for them;
+ *  - single shot requests get exactly one fix per start;
+ *  - with intervals of at least persist.gpsshim.duty_cycle ms (60s by
+ *    default, 0 disables it) the legacy engine is stopped once a fix of
+ *    the preferred accuracy was delivered, and restarted by the scheduler
+ *    thread shortly before the next one is due. The lead time is learned from how long restarts took to fix.
+ *
+ * What the legacy library is told, and whether the engine is duty cycled,
+ * can be tuned per device with the position mode policies in
+ * persist.gpsshim.policy (POLICY_PATH by default, see policy.h), read once
+ * when the shim is first initialized: a policy may pick the legacy mode and
+ * fix frequency, keep the engine on or duty cycle it below the threshold,
+ * and seed the lead time, by mode, recurrence, interval and accuracy.
+ *
+ * Stopping the engine saves power at the cost of a restart before every
+ * fix, and the device may sleep through the restart; the statistics logged
+ * when a session stops report both sides (engine duty, restart time to fix,
+ * lateness against the requested interval).
+ *
+ * Legacy start/stop calls are serialized by engineLock and are never made
+ * with schedLock held, because the legacy library may wait for its callback
+ * thread, which takes schedLock for every fix.
+ */
+#define SCHED_SLACK_MS          200     /* a fix this early still counts as on time */
+#define SCHED_MIN_OFF_MS        5000    /* not worth stopping the engine for less */
+#define SCHED_DEFAULT_LEAD_MS   8000
+#define SCHED_LEAD_MARGIN_MS    1000
+#define POLICY_PATH             "/system/etc/gpsshim-policy.conf"
+
+static pthread_mutex_t engineLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t schedLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t schedCond = PTHREAD_COND_INITIALIZER;
+static int schedRunning = 0;
+static int schedQuit = 0;
+static int schedExited = 0;     /* the thread can't be joined, see dispatcherExited */
+static uint32_t schedDutyThreshold = 60000;
+static int policiesLoaded = 0;
+
+/* Requested by the framework */
+static GpsPositionRecurrence schedRecurrence = GPS_POSITION_RECURRENCE_PERIODIC;
+static uint32_t schedInterval = 1000;
+static uint32_t schedAccuracy = 0;
+static uint32_t schedLeadTime = SCHED_DEFAULT_LEAD_MS;
+static int schedSchedule = POLICY_SCHEDULE_AUTO;    /* from the matching policy */
+
+/* State, all times in ms on the monotonic clock; guarded by schedLock */
+static int sessionActive = 0;
+static int engineOn = 0;
+static int stopRequested = 0;
+static int windowFixed = 0;         /* the engine produced a fix since it was started */
+static int windowDelivered = 0;     /* ...and one was delivered */
+static int64_t sessionStarted = 0;
+static int64_t engineStarted = 0;
+static int64_t lastDelivered = 0;
+static int64_t nextStart = 0;       /* 0 if no restart is scheduled */
+
+static struct {
+    uint32_t received;
+    uint32_t delivered;
+    uint32_t throttled;
+    uint32_t cycles;            /* engine starts */
+    uint32_t fixedCycles;       /* ...that got a fix */
+    uint32_t accuracyTimeouts;  /* engine stopped without reaching the preferred accuracy */
+    int64_t engineOnTime;
+    int64_t timeToFix;          /* summed over fixedCycles */
+    int64_t lateness;           /* summed over delivered fixes after the first */
+    uint32_t wakelockAcquisitions;  /* dispatcher counters when the session started */
+    int64_t wakelockHeldTime;
+} schedStats;
+
+/* Warm start
+ *
+ * The last good fix (with an accuracy of at most
+ * persist.gpsshim.warm_max_accuracy meters, 100 by default) is saved with
+ * the system clock offset seen at that moment in a small state file
+ * (persist.gpsshim.state, empty to disable) when a session stops. When the
+ * next session starts within persist.gpsshim.warm_max_age_min minutes (120
+ * by default), position and time are injected into the legacy engine before
+ * it is started, with their uncertainty grown by the age of the state.
+ * Time to first fix is logged for every session either way.
+ */
+#define SHIM_STATE_PATH     "/data/system/gpsshim-state.bin"
+#define SHIM_STATE_MAGIC    0x54415453      /* "STAT" */
+#define SHIM_STATE_VERSION  1
+#define STATE_DRIFT_MPS     10              /* assumed movement since the fix */
+#define STATE_CLOCK_PPM     100             /* assumed system clock drift */
+#define STATE_MAX_OFFSET    86400000LL      /* a wall clock this far off was not set */
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    double   latitude;
+    double   longitude;
+    float    accuracy;
+    uint32_t reserved;
+    int64_t  fixTime;       /* GPS UTC milliseconds */
+    int64_t  wallTime;      /* system clock when the fix arrived */
+} ShimState;
+
+static char statePath[PROPERTY_VALUE_MAX];
+static float warmMaxAccuracy = 100;
+static int64_t warmMaxAge = 120 * 60000LL;
+
+/* Guarded by schedLock */
+static ShimState lastGoodFix;
+static int lastGoodFixDirty = 0;
+static int warmStarted = 0;
+static int64_t sessionFirstFix = 0;
+
+/* schedLock held */
+static void state_record(const OldGpsLocation *location) {
+    if (!(location->flags & GPS_LOCATION_HAS_LAT_LONG) ||
+            !(location->flags & GPS_LOCATION_HAS_ACCURACY) ||
+            location->accuracy > warmMaxAccuracy)
+        return;
+    lastGoodFix.latitude = location->latitude;
+    lastGoodFix.longitude = location->longitude;
+    lastGoodFix.accuracy = location->accuracy;
+    lastGoodFix.fixTime = location->timestamp;
+    lastGoodFix.wallTime = wall_time_ms();
+    lastGoodFixDirty = 1;
+}
+
+static void state_save() {
+    ShimState state;
+
+    pthread_mutex_lock(&schedLock);
+    state = lastGoodFix;
+    if (!lastGoodFixDirty || !statePath[0]) {
+        pthread_mutex_unlock(&schedLock);
+        return;
+    }
+    lastGoodFixDirty = 0;
+    pthread_mutex_unlock(&schedLock);
+
+    state.magic = SHIM_STATE_MAGIC;
+    state.version = SHIM_STATE_VERSION;
+    state.reserved = 0;
+    persist_replace(statePath, &state, sizeof(state), NULL, 0);
+}
+
+/* SystemClock.elapsedRealtime(), the time base of inject_time() references */
+static int64_t elapsed_realtime_ms() {
+#ifdef HAVE_ANDROID_OS
+    struct timespec ts;
+    int fd = open("/dev/alarm", O_RDONLY);
+    if (fd >= 0) {
+        int ret = ioctl(fd, ANDROID_ALARM_GET_TIME(ANDROID_ALARM_ELAPSED_REALTIME), &ts);
+        close(fd);
+        if (ret == 0)
+            return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+    }
+#endif
+    return now_ms();
+}
+
+/* engineLock held, before the engine is started. Returns 1 if anything was injected. */
+static int state_inject() {
+    ShimState state;
+    int64_t wall = wall_time_ms(), age, offset;
+
+    if (!statePath[0] || persist_read(statePath, &state, sizeof(state)) ||
+            state.magic != SHIM_STATE_MAGIC || state.version != SHIM_STATE_VERSION)
+        return 0;
+    age = wall - state.wallTime;
+    if (age < 0 || age > warmMaxAge)
+        return 0;
+
+    offset = state.fixTime - state.wallTime;
+    if (offset > -STATE_MAX_OFFSET && offset < STATE_MAX_OFFSET)
+        originalGpsInterface->inject_time(wall + offset, elapsed_realtime_ms(),
+                                          500 + age * STATE_CLOCK_PPM / 1000000);
+    originalGpsInterface->inject_location(state.latitude, state.longitude,
+                                          state.accuracy + age / 1000 * STATE_DRIFT_MPS);
+    LOGI("Warm start from a fix %lld s old", (long long)(age / 1000));
+    return 1;
+}
+
+/* schedLock held */
+static int sched_duty_cycling() {
+    if (schedRecurrence != GPS_POSITION_RECURRENCE_PERIODIC ||
+            schedSchedule == POLICY_SCHEDULE_ON ||
+            schedInterval < schedLeadTime + SCHED_MIN_OFF_MS)
+        return 0;
+    return schedSchedule == POLICY_SCHEDULE_CYCLE ||
+           (schedDutyThreshold && schedInterval >= schedDutyThreshold);
+}
+
+/*
+ * Legacy callback thread: decide whether this fix is due at the framework.
+ * *force is set for fixes the change filter must not hold back: single-shot
+ * fixes and the first one of a session. Nothing counts as delivered until
+ * sched_forwarded() says so.
+ */
+static int sched_location(const OldGpsLocation *location, int *force) {
+    int64_t now = now_ms();
+    int deliver, ttf;
+
+    pthread_mutex_lock(&schedLock);
+    schedStats.received++;
+    if (!sessionFirstFix)
+        sessionFirstFix = now;
+    state_record(location);
+    if (engineOn && !windowFixed) {
+        windowFixed = 1;
+        ttf = now - engineStarted;
+        schedStats.fixedCycles++;
+        schedStats.timeToFix += ttf;
+        if (sched_duty_cycling())
+            schedLeadTime = (schedLeadTime * 3 + ttf + SCHED_LEAD_MARGIN_MS) / 4;
+    }
+
+    if (schedRecurrence == GPS_POSITION_RECURRENCE_SINGLE)
+        deliver = !windowDelivered;
+    else
+        deliver = !lastDelivered || now - lastDelivered + SCHED_SLACK_MS >= schedInterval;
+    *force = schedRecurrence == GPS_POSITION_RECURRENCE_SINGLE || !lastDelivered;
+    if (!deliver)
+        schedStats.throttled++;
+    pthread_mutex_unlock(&schedLock);
+    return deliver;
+}
+
+/* Legacy callback thread: account for a fix that was, or was not, forwarded, and stop early once done */
+static void sched_forwarded(const OldGpsLocation *location, int forwarded) {
+    int64_t now = now_ms();
+    int accurate;
+
+    pthread_mutex_lock(&schedLock);
+    if (forwarded) {
+        if (lastDelivered && now - lastDelivered > schedInterval)
+            schedStats.lateness += now - lastDelivered - schedInterval;
+        lastDelivered = now;
+        windowDelivered = 1;
+        schedStats.delivered++;
+    }
+
+    accurate = !schedAccuracy ||
+               ((location->flags & GPS_LOCATION_HAS_ACCURACY) && location->accuracy <= schedAccuracy);
+    if (engineOn && windowDelivered && !stopRequested && schedSchedule != POLICY_SCHEDULE_ON &&
+            (schedRecurrence == GPS_POSITION_RECURRENCE_SINGLE || sched_duty_cycling())) {
+        if (!accurate && now - engineStarted > schedInterval / 2)
+            schedStats.accuracyTimeouts++;
+        if (accurate || now - engineStarted > schedInterval / 2) {
+            stopRequested = 1;
+            pthread_cond_signal(&schedCond);
+        }
+    }
+    pthread_mutex_unlock(&schedLock);
+}
+
+/* engineLock held, schedLock not */
+static int engine_start() {
+    int ret;
+
+    ret = originalGpsInterface->start();
+    pthread_mutex_lock(&schedLock);
+    engineOn = 1;
+    engineStarted = now_ms();
+    windowFixed = windowDelivered = 0;
+    stopRequested = 0;
+    schedStats.cycles++;
+    pthread_mutex_unlock(&schedLock);
+    return ret;
+}
+
+/* engineLock held, schedLock not */
+static int engine_stop() {
+    int ret = originalGpsInterface->stop();
+    pthread_mutex_lock(&schedLock);
+    if (engineOn)
+        schedStats.engineOnTime += now_ms() - engineStarted;
+    engineOn = 0;
+    pthread_mutex_unlock(&schedLock);
+    return ret;
+}
+
+static void sched_loop(void *unused) {
+    struct timespec deadline;
+    int64_t now, wait;
+    int action;
+
+    LOGV("Scheduler running");
+    pthread_mutex_lock(&schedLock);
+    while (!schedQuit) {
+        now = now_ms();
+        action = 0;
+        if (stopRequested && engineOn)
+            action = -1;
+        else if (nextStart && now >= nextStart)
+            action = 1;
+
+        if (action == 0) {
+            if (!nextStart) {
+                pthread_cond_wait(&schedCond, &schedLock);
+                continue;
+            }
+            wait = nextStart - now;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += wait / 1000;
+            deadline.tv_nsec += (wait % 1000) * 1000000;
+            if (deadline.tv_nsec >= 1000000000) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000;
+            }
+            pthread_cond_timedwait(&schedCond, &schedLock, &deadline);
+            continue;
+        }
+
+        /* Take engineLock first, then recheck: start/stop may have raced with us */
+        pthread_mutex_unlock(&schedLock);
+        pthread_mutex_lock(&engineLock);
+        pthread_mutex_lock(&schedLock);
+        if (action < 0 && sessionActive && engineOn && stopRequested) {
+            stopRequested = 0;
+            if (schedRecurrence == GPS_POSITION_RECURRENCE_PERIODIC)
+                nextStart = lastDelivered + schedInterval - schedLeadTime;
+            pthread_mutex_unlock(&schedLock);
+            LOGV("Duty cycle: engine off for %lld ms", (long long)(nextStart ? nextStart - now_ms() : 0));
+            engine_stop();
+        } else if (action > 0 && sessionActive && !engineOn && nextStart && now_ms() >= nextStart) {
+            nextStart = 0;
+            pthread_mutex_unlock(&schedLock);
+            LOGV("Duty cycle: engine on");
+            engine_start();
+        } else {
+            stopRequested = 0;
+            pthread_mutex_unlock(&schedLock);
+        }
+        pthread_mutex_unlock(&engineLock);
+        pthread_mutex_lock(&schedLock);
+    }
+    /* Still under schedLock, so sched_stop() sees this only once we are done */
+    schedExited = 1;
+    pthread_cond_broadcast(&schedCond);
+    pthread_mutex_unlock(&schedLock);
+    LOGV("Scheduler exiting");
+}
+
+static void sched_start() {
+    if (schedRunning)
+        return;
+    schedQuit = 0;
+    schedExited = 0;
+    originalCallbacks->create_thread_cb("gpsshim-sched", sched_loop, NULL);
+    schedRunning = 1;
+}
+
+static void sched_stop() {
+    if (!schedRunning)
+        return;
+    pthread_mutex_lock(&schedLock);
+    schedQuit = 1;
+    pthread_cond_signal(&schedCond);
+    while (!schedExited)
+        pthread_cond_wait(&schedCond, &schedLock);
+    pthread_mutex_unlock(&schedLock);
+    schedRunning = 0;
+}
+
+static void sched_log_session() {
+    int64_t session = now_ms() - sessionStarted;
+
+    LOGI("Session of %lld s, interval %u ms%s: engine on %d%% of the time in %u starts, "
+         "fixes: %u received, %u delivered, %u throttled",
+         (long long)(session / 1000), schedInterval,
+         schedRecurrence == GPS_POSITION_RECURRENCE_SINGLE ? " (single shot)" : "",
+         session ? (int)(schedStats.engineOnTime * 100 / session) : 0, schedStats.cycles,
+         schedStats.received, schedStats.delivered, schedStats.throttled);
+    LOGI("Start to fix %lld ms avg, lead time %u ms, late by %lld ms avg, "
+         "%u accuracy timeouts",
+         (long long)(schedStats.fixedCycles ? schedStats.timeToFix / schedStats.fixedCycles : 0),
+         schedLeadTime,
+         (long long)(schedStats.delivered > 1 ? schedStats.lateness / (schedStats.delivered - 1) : 0),
+         schedStats.accuracyTimeouts);
+    if (sessionFirstFix)
+        LOGI("Time to first fix %lld ms (%s start)", (long long)(sessionFirstFix - sessionStarted),
+             warmStarted ? "warm" : "cold");
+    else
+        LOGI("No fix this session (%s start)", warmStarted ? "warm" : "cold");
+    LOGI("Wakelock taken %u times, held %lld ms (%d%% of the session)",
+         wakelockAcquisitions - schedStats.wakelockAcquisitions,
+         (long long)(wakelock_held_time() - schedStats.wakelockHeldTime),
+         session ? (int)((wakelock_held_time() - schedStats.wakelockHeldTime) * 100 / session) : 0);
+}
+
+/* Legacy callback thread */
+static void batch_flush() {
+    int32_t head = batchHead;
+    ShimEvent *event;
+
+    if (head == android_atomic_acquire_load(&batchFlushed))
+        return;
+    event = event_reserve(&coreRing, SHIM_EVENT_FIX_BATCH);
+    if (event == NULL)
+        return;
+    event->u.batch_end = head;
+    android_atomic_release_store(head, &batchFlushed);
+    batchFlushes++;
+    event_publish(&coreRing);
+}
+
+/* Any other thread: queue the flush between the legacy callbacks, like one of them */
+static void batch_flush_request() {
+    pthread_mutex_lock(&callbackLock);
+    batch_flush();
+    pthread_mutex_unlock(&callbackLock);
+}
+
+/* Legacy callback thread */
+/* Legacy callback thread: park a fix without flushing. Returns 0 if the ring is full. */
+static int batch_park(const GpsLocation *location, int64_t now) {
+    int32_t head = batchHead;
+
+    if (head - android_atomic_acquire_load(&batchTail) >= SHIM_BATCH_SLOTS) {
+        batchDropped++;
+        if ((batchDropped & (batchDropped - 1)) == 0)
+            LOGW("Fix batch full, dropped %u fixes so far", batchDropped);
+        return 0;
+    }
+    batchSlots[head & (SHIM_BATCH_SLOTS - 1)] = *location;
+    android_atomic_release_store(head + 1, &batchHead);
+
+    if (head == android_atomic_acquire_load(&batchFlushed))
+        batchOldest = now;
+    return 1;
+}
+
+/* Legacy callback thread */
+static void batch_append(const GpsLocation *location) {
+    int64_t now = now_ms();
+    int32_t maxAge = android_atomic_acquire_load(&batchMaxAge);
+
+    if (!batch_park(location, now))
+        return;
+    if (batchHead - android_atomic_acquire_load(&batchFlushed) >=
+            android_atomic_acquire_load(&batchMaxFixes) ||
+            (maxAge && now - batchOldest >= maxAge))
+        batch_flush();
+}
+
+/*
+ * Core ring overflow: fixes that find no room are parked like a batch,
+ * and so are the ones after them until the parked fixes could be flushed,
+ * to keep them in order. The next fix, SV status or status that sees room
+ * in the ring queues the flush. Legacy callback thread.
+ */
+static void overflow_flush() {
+    if (overflowPending && ring_depth(&coreRing) < SHIM_CORE_SLOTS - SHIM_CORE_RESERVED) {
+        overflowPending = 0;
+        batch_flush();
+    }
+}
+
+static void overflow_park(const GpsLocation *location) {
+    overflowPending = 1;
+    if (batch_park(location, now_ms()))
+        overflowParked++;
+    overflow_flush();
+}
+
+static int batch_set(int max_fixes, uint32_t max_age_ms) {
+    if (max_fixes < 0)
+        return -1;
+    /* Leave room for fixes that arrive while a burst is being delivered */
+    if (max_fixes > SHIM_BATCH_SLOTS / 2)
+        max_fixes = SHIM_BATCH_SLOTS / 2;
+
+    android_atomic_release_store(max_age_ms, &batchMaxAge);
+    android_atomic_release_store(max_fixes, &batchMaxFixes);
+
+    if (!max_fixes)
+        batch_flush_request();
+    LOGI("Fix batching %s (%d fixes, %u ms)", max_fixes ? "on" : "off", max_fixes, max_age_ms);
+    return 0;
+}
+
+static const GpsShimBatchingInterface shimBatching = {
+    sizeof(GpsShimBatchingInterface),
+    batch_set,
+    batch_flush_request,
+};
+
+static const GpsShimStatsInterface shimStats = {
+    sizeof(GpsShimStatsInterface),
+    stats_dump,
+};
+
+/*
+ * Geofences are tested against every fix the engine produces, throttled or
+ * filtered ones included, so an application can keep a long min_interval
+ * and still be told about transitions; see geofence.h. Cells are
+ * persist.gpsshim.geofence_cell_m wide (2km by default).
+ */
+static void geofence_init_wrapper(GpsShimGeofenceCallbacks *callbacks) {
+    geofenceCallbacks = callbacks;
+}
+
+/* Legacy callback thread */
+static void geofence_transition(int32_t id, int32_t transition, const GpsLocation *location) {
+    ShimEvent *event = event_reserve(&coreRing, SHIM_EVENT_GEOFENCE);
+
+    LOGV("Geofence %d transition %d", id, transition);
+    if (event == NULL)
+        return;
+    event->u.geofence.id = id;
+    event->u.geofence.transition = transition;
+    event->u.geofence.location = *location;
+    event_publish(&coreRing);
+}
+
+static const GpsShimGeofenceInterface shimGeofence = {
+    sizeof(GpsShimGeofenceInterface),
+    geofence_init_wrapper,
+    geofence_add_circle,
+    geofence_add_polygon,
+    geofence_remove,
+};
+
+/* Publish the open NMEA batch, if any. Legacy callback thread only. */
+static void nmea_batch_flush() {
+    if (nmeaBatch == NULL)
+        return;
+    nmeaBatch = NULL;
+    nmeaBatches++;
+    event_publish(&nmeaRing);
+}
+
+/*
+ * Batching mode (persist.gpsshim.nmea_batch=1): sentences of one fix epoch
+ * are appended to a single reserved slot and delivered with one nmea_cb
+ * call, timestamped with the epoch. An epoch ends when the timestamp
+ * changes, when a sentence type that appears once per epoch (GGA, RMC...)
+ * shows up again, when the slot is full, or when any other core event is
+ * produced, so that an epoch does not stay queued behind a fix.
+ */
+static void nmea_batch_append(GpsUtcTime timestamp, const char* nmea, int length, int type) {
+    int used;
+
+    if (nmeaBatch && (nmeaBatch->u.nmea.timestamp != timestamp ||
+                      (nmeaBatchTypes & type & ~NMEA_TYPES_REPEATABLE) ||
+                      nmeaBatch->u.nmea.length + length >= SHIM_NMEA_MAX))
+        nmea_batch_flush();
+
+    if (nmeaBatch == NULL) {
+        nmeaBatch = event_reserve(&nmeaRing, SHIM_EVENT_NMEA);
+        if (nmeaBatch == NULL)
+            return;
+        nmeaBatch->u.nmea.timestamp = timestamp;
+        nmeaBatch->u.nmea.length = 0;
+        nmeaBatchTypes = 0;
+    }
+
+    used = nmeaBatch->u.nmea.length;
+    memcpy(NMEA_SENTENCE(nmeaBatch) + used, nmea, length);
+    NMEA_SENTENCE(nmeaBatch)[used + length] = '\0';
+    nmeaBatch->u.nmea.length = used + length;
+    nmeaBatchTypes |= type;
+}
+
+/* Change suppression
+ *
+ * The satellite view rarely changes within a second and a parked receiver
+ * keeps producing the same fix, so both are filtered on the legacy callback
+ * thread before they are queued (persist.gpsshim.change_filter, on by
+ * default):
+ *
+ *  - SV status is forwarded when the set of satellites or any of the masks
+ *    change, when a satellite's snr moves by persist.gpsshim.sv_snr_delta dB
+ *    or its elevation/azimuth by persist.gpsshim.sv_angle_delta degrees, and
+ *    at least every persist.gpsshim.sv_keepalive_ms;
+ *  - a fix within persist.gpsshim.stationary_m meters of the last forwarded
+ *    one (0, the default, only collapses identical positions), with the same
+ *    flags and not moving, is dropped unless persist.gpsshim.fix_keepalive_ms
+ *    have passed since the last forwarded fix. The first fix of a session
+ *    and single-shot fixes always go through.
+ */
+static int changeFilter = 1;
+static float svSnrDelta = 2.0f;
+static float svAngleDelta = 5.0f;
+static int svKeepAlive = 5000;
+static float fixStationaryRadius = 0.0f;
+static int fixKeepAlive = 10000;
+
+static OldGpsSvStatus svLast;
+static int64_t svLastForwarded = 0;
+static uint32_t svSuppressed = 0;
+static GpsLocation fixLast;
+static int64_t fixLastForwarded = 0;
+static uint32_t fixSuppressed = 0;
+
+#define STATIONARY_SPEED    0.5f    /* m/s */
+#define METERS_PER_DEGREE   111320.0
+
+static int sv_changed(const OldGpsSvStatus *sv, int num_svs) {
+    int i;
+
+    if (num_svs != svLast.num_svs || sv->ephemeris_mask != svLast.ephemeris_mask ||
+            sv->almanac_mask != svLast.almanac_mask ||
+            sv->used_in_fix_mask != svLast.used_in_fix_mask)
+        return 1;
+    for (i = 0; i < num_svs; i++) {
+        const OldGpsSvInfo *a = &sv->sv_list[i], *b = &svLast.sv_list[i];
+        if (a->prn != b->prn || fabsf(a->snr - b->snr) >= svSnrDelta ||
+                fabsf(a->elevation - b->elevation) >= svAngleDelta ||
+                fabsf(a->azimuth - b->azimuth) >= svAngleDelta)
+            return 1;
+    }
+    return 0;
+}
+
+/* Legacy callback thread: 1 if this SV status should be forwarded */
+static int sv_filter(const OldGpsSvStatus *sv, int num_svs) {
+    int64_t now;
+
+    if (!changeFilter)
+        return 1;
+    now = now_ms();
+    if (svLastForwarded && now - svLastForwarded < svKeepAlive && !sv_changed(sv, num_svs)) {
+        svSuppressed++;
+        return 0;
+    }
+    svLast.num_svs = num_svs;
+    memcpy(svLast.sv_list, sv->sv_list, num_svs * sizeof(OldGpsSvInfo));
+    svLast.ephemeris_mask = sv->ephemeris_mask;
+    svLast.almanac_mask = sv->almanac_mask;
+    svLast.used_in_fix_mask = sv->used_in_fix_mask;
+    svLastForwarded = now;
+    return 1;
+}
+
+static int fix_stationary(const GpsLocation *location) {
+    double dlat, dlon;
+
+    if (location->flags != fixLast.flags)
+        return 0;
+    if ((location->flags & GPS_LOCATION_HAS_SPEED) && location->speed >= STATIONARY_SPEED)
+        return 0;
+    if (location->latitude == fixLast.latitude && location->longitude == fixLast.longitude)
+        return 1;
+    if (fixStationaryRadius <= 0)
+        return 0;
+    dlat = (location->latitude - fixLast.latitude) * METERS_PER_DEGREE;
+    dlon = (location->longitude - fixLast.longitude) * METERS_PER_DEGREE *
+           cos(location->latitude * M_PI / 180);
+    return dlat * dlat + dlon * dlon <= fixStationaryRadius * fixStationaryRadius;
+}
+
+/* Legacy callback thread: 1 if this fix should be forwarded, always if force is set */
+static int fix_filter(const GpsLocation *location, int force) {
+    int64_t now;
+
+    if (!changeFilter)
+        return 1;
+    now = now_ms();
+    if (!force && fixLastForwarded && now - fixLastForwarded < fixKeepAlive && fix_stationary(location)) {
+        fixSuppressed++;
+        return 0;
+    }
+    fixLast = *location;
+    fixLastForwarded = now;
+    return 1;
+}
+
+/* Same fix epoch if the sentence time matches the fix time of day */
+static int nmea_matches_fix(const NmeaSentence *sentence, int32_t time, GpsUtcTime timestamp) {
+    return (sentence->flags & NMEA_HAS_TIME) && time == (int32_t)(timestamp % 86400000LL);
+}
+
+/* Fill in what the legacy fix lacks from this epoch's GGA and RMC */
+static void location_complete(GpsLocation *location) {
+    uint16_t flags = location->flags;
+
+    if (!(flags & GPS_LOCATION_HAS_ALTITUDE) &&
+            (nmeaLastGga.flags & NMEA_HAS_ALTITUDE) &&
+            nmea_matches_fix(&nmeaLastGga, nmeaLastGga.u.gga.time, location->timestamp)) {
+        location->altitude = nmeaLastGga.u.gga.altitude;
+        location->flags |= GPS_LOCATION_HAS_ALTITUDE;
+    }
+    if (nmea_matches_fix(&nmeaLastRmc, nmeaLastRmc.u.rmc.time, location->timestamp)) {
+        if (!(flags & GPS_LOCATION_HAS_SPEED) && (nmeaLastRmc.flags & NMEA_HAS_SPEED)) {
+            location->speed = nmeaLastRmc.u.rmc.speed;
+            location->flags |= GPS_LOCATION_HAS_SPEED;
+        }
+        if (!(flags & GPS_LOCATION_HAS_BEARING) && (nmeaLastRmc.flags & NMEA_HAS_BEARING)) {
+            location->bearing = nmeaLastRmc.u.rmc.bearing;
+            location->flags |= GPS_LOCATION_HAS_BEARING;
+        }
+    }
+    if (location->flags != flags)
+        locationsCompleted++;
+}
+
+static void location_callback(OldGpsLocation *location) {
+    ShimEvent *event;
+    GpsLocation newLocation;
+    int forward, force;
+    trace_record(TRACE_LOCATION, location, sizeof(*location), NULL, 0);
+    nmea_batch_flush();
     LOGV("I have a location");
     newLocation.size = sizeof(GpsLocation);
     newLocation.flags = location->flags;
@@ -57,58 +1570,169 @@ static void location_callback_wrapper(OldGpsLocation *location) {
     newLocation.bearing = location->bearing;
     newLocation.accuracy = location->accuracy;
     newLocation.timestamp = location->timestamp;
-    originalCallbacks->create_thread_cb("gpsshim-location",(void *)originalCallbacks->location_cb,(void *)&newLocation);
+    location_complete(&newLocation);
+    /* Local consumers get every fix, scheduling and filtering are for the framework */
+    feed_fix(&newLocation);
+    if (geofenceCallbacks != NULL)
+        geofence_update(&newLocation, geofence_transition);
+    forward = sched_location(location, &force) && fix_filter(&newLocation, force);
+    sched_forwarded(location, forward);
+    if (!forward)
+        return;
+
+    if (android_atomic_acquire_load(&batchMaxFixes)) {
+        batch_append(&newLocation);
+        return;
+    }
+    if (overflowPending || ring_depth(&coreRing) >= SHIM_CORE_SLOTS - SHIM_CORE_RESERVED) {
+        overflow_park(&newLocation);
+        return;
+    }
+    /* Batching was just turned off: whatever is still parked goes first */
+    batch_flush();
+    event = event_reserve(&coreRing, SHIM_EVENT_LOCATION);
+    if (event == NULL)
+        return;
+    event->u.location = newLocation;
+    event_publish(&coreRing);
 }
 
-static void status_callback_wrapper(OldGpsStatus *status) {
-    static GpsStatus newStatus;
-    newStatus.size = sizeof(GpsStatus);
+static void status_callback(OldGpsStatus *status) {
+    ShimEvent *event;
+    trace_record(TRACE_STATUS, status, sizeof(*status), NULL, 0);
+    nmea_batch_flush();
+    overflow_flush();
+    event = event_reserve(&coreRing, SHIM_EVENT_STATUS);
     LOGV("Status value is %u",status->status);
-    newStatus.status = status->status;
-    originalCallbacks->create_thread_cb("gpsshim-status",(void *)originalCallbacks->status_cb,(void *)&newStatus);
+    if (event == NULL)
+        return;
+    event->u.status.size = sizeof(GpsStatus);
+    event->u.status.status = status->status;
+    event_publish(&coreRing);
 }
 
-static void svstatus_callback_wrapper(OldGpsSvStatus *sv_info) {
-    static GpsSvStatus newSvStatus;
+static void svstatus_callback(OldGpsSvStatus *sv_info) {
+    ShimEvent *event;
+    GpsSvStatus *newSvStatus;
     int i=0;
+    int num_svs = sv_info->num_svs < GPS_MAX_SVS ? sv_info->num_svs : GPS_MAX_SVS;
+    TraceSvStatus traceSv;
+    if (num_svs < 0)
+        num_svs = 0;
+    traceSv.num_svs = num_svs;
+    traceSv.ephemeris_mask = sv_info->ephemeris_mask;
+    traceSv.almanac_mask = sv_info->almanac_mask;
+    traceSv.used_in_fix_mask = sv_info->used_in_fix_mask;
+    trace_record(TRACE_SV_STATUS, &traceSv, sizeof(traceSv),
+                 sv_info->sv_list, num_svs * sizeof(OldGpsSvInfo));
+    nmea_batch_flush();
+    overflow_flush();
     LOGV("I have a svstatus");
-    newSvStatus.size = sizeof(GpsSvStatus);
-    newSvStatus.num_svs = sv_info->num_svs;
-    for (i=0; i<newSvStatus.num_svs; i++) {
-        newSvStatus.sv_list[i].size = sizeof(GpsSvInfo);
-        newSvStatus.sv_list[i].prn = sv_info->sv_list[i].prn;
-        newSvStatus.sv_list[i].snr = sv_info->sv_list[i].snr;
-        newSvStatus.sv_list[i].elevation = sv_info->sv_list[i].elevation;
-        newSvStatus.sv_list[i].azimuth = sv_info->sv_list[i].azimuth;
+    if (!sv_filter(sv_info, num_svs))
+        return;
+    event = latest_back(&svLatest, SHIM_EVENT_SV_STATUS);
+    newSvStatus = SV_STATUS(event);
+    newSvStatus->size = sizeof(GpsSvStatus);
+    newSvStatus->num_svs = num_svs;
+    for (i=0; i<newSvStatus->num_svs; i++) {
+        newSvStatus->sv_list[i].size = sizeof(GpsSvInfo);
+        newSvStatus->sv_list[i].prn = sv_info->sv_list[i].prn;
+        newSvStatus->sv_list[i].snr = sv_info->sv_list[i].snr;
+        newSvStatus->sv_list[i].elevation = sv_info->sv_list[i].elevation;
+        newSvStatus->sv_list[i].azimuth = sv_info->sv_list[i].azimuth;
     }
-    newSvStatus.ephemeris_mask = sv_info->ephemeris_mask;
-    newSvStatus.almanac_mask = sv_info->almanac_mask;
-    newSvStatus.used_in_fix_mask = sv_info->used_in_fix_mask;
-    originalCallbacks->create_thread_cb("gpsshim-svstatus",(void *)originalCallbacks->sv_status_cb,(void *)&newSvStatus);
+    newSvStatus->ephemeris_mask = sv_info->ephemeris_mask;
+    newSvStatus->almanac_mask = sv_info->almanac_mask;
+    newSvStatus->used_in_fix_mask = sv_info->used_in_fix_mask;
+    latest_publish(&svLatest);
 }
 
-GpsUtcTime nmeasave_timestamp; const char* nmeasave_nmea; int nmeasave_length;
+static void nmea_callback(GpsUtcTime timestamp, const char* nmea, int length) {
+    ShimEvent *event;
+    const NmeaSentence *parsed = NULL;
+    int type = NMEA_TYPE_OTHER;
+
+    /* Malformed sentences still get copied when nmeaCheck is off */
+    if (nmea == NULL || length < 0) {
+        nmea = "";
+        length = 0;
+    }
+    if (length > 0)
+        trace_record(TRACE_NMEA, &timestamp, sizeof(timestamp), nmea, length);
+    if (nmea_parse(nmea, length, &nmeaParsed) == NMEA_OK) {
+        parsed = &nmeaParsed;
+        type = nmeaParsed.type;
+        if (type == NMEA_TYPE_GGA)
+            nmeaLastGga = nmeaParsed;
+        else if (type == NMEA_TYPE_RMC)
+            nmeaLastRmc = nmeaParsed;
+    } else {
+        nmeaMalformed++;
+        LOGV("Malformed NMEA sentence: %.*s", length, nmea);
+        if (nmeaCheck)
+            return;
+    }
+
+    feed_nmea(timestamp, nmea, length, parsed);
 
-static void nmea_callback(void *unused) {
-    LOGV("Invoking nmea callback");
-    originalCallbacks->nmea_cb(nmeasave_timestamp, nmeasave_nmea, nmeasave_length);
+    /* The legacy library may reuse its buffer as soon as we return */
+    if (length >= SHIM_NMEA_MAX) {
+        nmeaTruncated++;
+        length = SHIM_NMEA_MAX - 1;
+    }
+    nmeaSentences++;
+    if (nmeaBatching) {
+        nmea_batch_append(timestamp, nmea, length, type);
+        return;
+    }
+
+    event = event_reserve(&nmeaRing, SHIM_EVENT_NMEA);
+    if (event == NULL)
+        return;
+    memcpy(NMEA_SENTENCE(event), nmea, length);
+    NMEA_SENTENCE(event)[length] = '\0';
+    event->u.nmea.timestamp = timestamp;
+    event->u.nmea.length = length;
+    event_publish(&nmeaRing);
 }
 
-static void nmea_callback_wrapper(GpsUtcTime timestamp, const char* nmea, int length) {
-    nmeasave_timestamp = timestamp; nmeasave_nmea = nmea; nmeasave_length=length;
-    originalCallbacks->create_thread_cb("gpsshim-nmea",(void *)nmea_callback,NULL);
+/* Legacy callbacks may come from any thread, see callbackLock */
+static void location_callback_wrapper(OldGpsLocation *location) {
+    pthread_mutex_lock(&callbackLock);
+    location_callback(location);
+    pthread_mutex_unlock(&callbackLock);
 }
 
-static OldAGpsCallbacks oldAGpsCallbacks;
-static const AGpsCallbacks* newAGpsCallbacks = NULL;
+static void status_callback_wrapper(OldGpsStatus *status) {
+    pthread_mutex_lock(&callbackLock);
+    status_callback(status);
+    pthread_mutex_unlock(&callbackLock);
+}
+
+static void svstatus_callback_wrapper(OldGpsSvStatus *sv_info) {
+    pthread_mutex_lock(&callbackLock);
+    svstatus_callback(sv_info);
+    pthread_mutex_unlock(&callbackLock);
+}
+
+static void nmea_callback_wrapper(GpsUtcTime timestamp, const char* nmea, int length) {
+    pthread_mutex_lock(&callbackLock);
+    nmea_callback(timestamp, nmea, length);
+    pthread_mutex_unlock(&callbackLock);
+}
 
 static void agps_status_cb(OldAGpsStatus* status)
 {
-    AGpsStatus newAGpsStatus;
-    newAGpsStatus.size = sizeof(AGpsStatus);
-    newAGpsStatus.type = status->type;
-    newAGpsStatus.status = status->status;
-    newAGpsCallbacks->create_thread_cb("gpsshim-agpsstatus",(void *)newAGpsCallbacks->status_cb,(void*)&newAGpsStatus);
+    ShimEvent *event;
+    trace_record(TRACE_AGPS_STATUS, status, sizeof(*status), NULL, 0);
+    event = event_reserve(&agpsRing, SHIM_EVENT_AGPS_STATUS);
+    if (event == NULL)
+        return;
+    memset(&event->u.agps_status, 0, sizeof(AGpsStatus));
+    event->u.agps_status.size = sizeof(AGpsStatus);
+    event->u.agps_status.type = status->type;
+    event->u.agps_status.status = status->status;
+    event_publish(&agpsRing);
 }
 
 static void agps_init_wrapper(AGpsCallbacks * callbacks)
@@ -116,22 +1740,61 @@ static void agps_init_wrapper(AGpsCallbacks * callbacks)
     newAGpsCallbacks = callbacks;
     oldAGpsCallbacks.status_cb = agps_status_cb;
 
+    if (legacy_load() || oldAGPS == NULL)
+        return;
     oldAGPS->init(&oldAGpsCallbacks);
 }
 
-static OldAGpsRilCallbacks oldAGpsRilCallbacks;
-static const AGpsRilCallbacks* newAGpsRilCallbacks = NULL;
+static int agps_data_conn_open_wrapper(const char* apn)
+{
+    if (legacy_load() || oldAGPS == NULL)
+        return -1;
+    return oldAGPS->data_conn_open(apn);
+}
+
+static int agps_data_conn_closed_wrapper()
+{
+    if (legacy_load() || oldAGPS == NULL)
+        return -1;
+    return oldAGPS->data_conn_closed();
+}
+
+static int agps_data_conn_failed_wrapper()
+{
+    if (legacy_load() || oldAGPS == NULL)
+        return -1;
+    return oldAGPS->data_conn_failed();
+}
+
+static int agps_set_server_wrapper(AGpsType type, const char* hostname, int port)
+{
+    if (legacy_load() || oldAGPS == NULL)
+        return -1;
+    return oldAGPS->set_server(type, hostname, port);
+}
 
 static void agpsril_setid_cb(uint32_t flags)
 {
+    ShimEvent *event;
+    trace_record(TRACE_AGPSRIL_SETID, &flags, sizeof(flags), NULL, 0);
+    event = event_reserve(&agpsRing, SHIM_EVENT_AGPSRIL_SETID);
     LOGV("AGPSRIL setid callback");
-    newAGpsRilCallbacks->create_thread_cb("gpsshim-agpsril-setid",(void *)newAGpsRilCallbacks->request_setid,&flags);
+    if (event == NULL)
+        return;
+    event->u.agpsril_flags = flags;
+    event_publish(&agpsRing);
 }
 
 static void agpsril_refloc_cb(uint32_t flags)
 {
+    ShimEvent *event;
+    trace_record(TRACE_AGPSRIL_REFLOC, &flags, sizeof(flags), NULL, 0);
+    event = event_reserve(&agpsRing, SHIM_EVENT_AGPSRIL_REFLOC);
     LOGV("AGPSRIL refloc callback");
-    newAGpsRilCallbacks->create_thread_cb("gpsshim-agpsril-refloc",(void *)newAGpsRilCallbacks->request_refloc,&flags);
+    if (event == NULL)
+        return;
+    event->u.agpsril_flags = flags;
+    event_publish(&agpsRing);
 }
 
 static void agpsril_init_wrapper(AGpsRilCallbacks * callbacks)
@@ -141,114 +1804,442 @@ static void agpsril_init_wrapper(AGpsRilCallbacks * callbacks)
     oldAGpsRilCallbacks.request_refloc = agpsril_refloc_cb;
     LOGV("AGPSRIL init");
 
+    if (legacy_load() || oldAGPSRIL == NULL)
+        return;
     oldAGPSRIL->init(&oldAGpsRilCallbacks);
 }
 
-static OldGpsXtraCallbacks oldXtraCallbacks;
-static const GpsXtraCallbacks* newXtraCallbacks = NULL;
+static void agpsril_set_ref_location_wrapper(const AGpsRefLocation *agps_reflocation, size_t sz_struct)
+{
+    if (legacy_load() || oldAGPSRIL == NULL)
+        return;
+    oldAGPSRIL->set_ref_location(agps_reflocation, sz_struct);
+}
+
+static void agpsril_set_set_id_wrapper(AGpsSetIDType type, const char* setid)
+{
+    if (legacy_load() || oldAGPSRIL == NULL)
+        return;
+    oldAGPSRIL->set_set_id(type, setid);
+}
+
+static void agpsril_ni_message_wrapper(uint8_t *msg, size_t len)
+{
+    if (legacy_load() || oldAGPSRIL == NULL)
+        return;
+    oldAGPSRIL->ni_message(msg, len);
+}
+
+/*
+ * NI
+ *
+ * Notifications are copied into niRing and delivered ahead of everything
+ * else. The time each one came in is kept by id until the framework hands
+ * the user's answer back through respond(), to time the whole round trip.
+ * An answer to a notification we no longer remember, with more than
+ * SHIM_NI_PENDING of them outstanding, is only counted.
+ */
+#define SHIM_NI_PENDING     8
+
+typedef struct {
+    int id;
+    int64_t received;       /* ns, 0 when the entry is free */
+} ShimNiPending;
+
+static ShimNiPending niPending[SHIM_NI_PENDING];
+
+static void ni_notify_cb(GpsNiNotification *notification)
+{
+    ShimEvent *event;
+    ShimNiPending *pending = &niPending[0];
+    int i;
+
+    trace_record(TRACE_NI_NOTIFY, notification, sizeof(*notification), NULL, 0);
+    LOGV("NI notification %d", notification->notification_id);
+    event = event_reserve(&niRing, SHIM_EVENT_NI_NOTIFY);
+    if (event == NULL)
+        return;
+    *NI_NOTIFICATION(event) = *notification;
+
+    /* Still under niLock: the same id again, else a free or the oldest entry */
+    for (i = 0; i < SHIM_NI_PENDING; i++) {
+        if (niPending[i].received && niPending[i].id == notification->notification_id) {
+            pending = &niPending[i];
+            break;
+        }
+        if (niPending[i].received < pending->received)
+            pending = &niPending[i];
+    }
+    pending->id = notification->notification_id;
+    pending->received = now_ns();
+    niResponseStats.queued++;
+    event_publish(&niRing);
+}
+
+static void ni_init_wrapper(GpsNiCallbacks *callbacks)
+{
+    newNiCallbacks = callbacks;
+    oldNiCallbacks.notify_cb = ni_notify_cb;
+    oldNiCallbacks.create_thread_cb = callbacks->create_thread_cb;
+
+    if (legacy_load() || oldNI == NULL)
+        return;
+    oldNI->init(&oldNiCallbacks);
+}
+
+static void ni_respond_wrapper(int notif_id, GpsUserResponseType user_response)
+{
+    int64_t now = now_ns();
+    int i;
+
+    pthread_mutex_lock(&niLock);
+    for (i = 0; i < SHIM_NI_PENDING; i++) {
+        if (niPending[i].received && niPending[i].id == notif_id)
+            break;
+    }
+    if (i < SHIM_NI_PENDING) {
+        stats_account(&niResponseStats, (now - niPending[i].received) / 1000);
+        niPending[i].received = 0;
+    } else {
+        niResponseStats.dropped++;
+    }
+    pthread_mutex_unlock(&niLock);
+
+    if (legacy_load() || oldNI == NULL)
+        return;
+    oldNI->respond(notif_id, user_response);
+}
 
 static void xtra_download_cb()
 {
-    newXtraCallbacks->create_thread_cb("gpsshim-xtradownload",(void *)newXtraCallbacks->download_request_cb,NULL);
+    ShimEvent *event;
+    trace_record(TRACE_XTRA_DOWNLOAD, NULL, 0, NULL, 0);
+    event = event_reserve(&auxRing, SHIM_EVENT_XTRA_DOWNLOAD);
+    if (event != NULL)
+        event_publish(&auxRing);
+}
+
+/*
+ * XTRA data injected by the framework is kept in a cache file
+ * (persist.gpsshim.xtra_cache, empty to disable). At init, a cache younger
+ * than persist.gpsshim.xtra_validity_h hours (24 by default) is injected
+ * straight from its mapping and the initial download request is skipped.
+ */
+static char xtraCachePath[PROPERTY_VALUE_MAX];
+
+static int xtra_inject_wrapper(char* data, int length)
+{
+    int ret;
+
+    if (legacy_load() || oldXTRA == NULL)
+        return -1;
+    ret = oldXTRA->inject_xtra_data(data, length);
+    if (ret == 0 && xtraCachePath[0])
+        xtra_cache_store(xtraCachePath, data, length);
+    return ret;
+}
+
+static int xtra_inject_cached()
+{
+    XtraCacheMapping mapping;
+    char value[PROPERTY_VALUE_MAX];
+    int ret;
+
+    if (!xtraCachePath[0])
+        return -1;
+    property_get("persist.gpsshim.xtra_validity_h", value, "24");
+    if (xtra_cache_map(xtraCachePath, atoi(value) * 3600, &mapping))
+        return -1;
+    ret = oldXTRA->inject_xtra_data(mapping.data, mapping.length);
+    LOGI("Injected %d bytes of cached XTRA data, %ld min old: %d", mapping.length,
+         (long)mapping.age / 60, ret);
+    xtra_cache_unmap(&mapping);
+    return ret;
 }
 
 static int xtra_init_wrapper(GpsXtraCallbacks * callbacks)
 {
+    int ret;
+
     newXtraCallbacks = callbacks;
     oldXtraCallbacks.download_request_cb = xtra_download_cb;
+    property_get("persist.gpsshim.xtra_cache", xtraCachePath, XTRA_CACHE_PATH);
+
+    if (legacy_load() || oldXTRA == NULL)
+        return -1;
+    ret = oldXTRA->init(&oldXtraCallbacks);
+    if (xtra_inject_cached() == 0)
+        return ret;
 
 #ifdef NEEDS_INITIAL_XTRA
     xtra_download_cb();
 #endif
+    return ret;
+}
+
+/*
+ * Vendor extensions are handed out without loading the legacy library and
+ * resolved on their first call. Until it is loaded we cannot tell whether
+ * the vendor has one at all: a library that is already loaded is asked
+ * right away, otherwise calls into an extension the vendor turns out to
+ * lack do nothing and report failure.
+ */
+static int legacy_has_extension(const char *name)
+{
+    int has;
 
-    return oldXTRA->init(&oldXtraCallbacks);
+    pthread_mutex_lock(&legacyLock);
+    has = originalGpsInterface == NULL || originalGpsInterface->get_extension(name) != NULL;
+    pthread_mutex_unlock(&legacyLock);
+    return has;
 }
 
 static const void* wrapper_get_extension(const char* name)
 {
-    if (!strcmp(name, GPS_XTRA_INTERFACE) && (oldXTRA = originalGpsInterface->get_extension(name)))
+    if (!strcmp(name, GPS_XTRA_INTERFACE) && legacy_has_extension(name))
     {
         newXTRA.size = sizeof(GpsXtraInterface);
         newXTRA.init = xtra_init_wrapper;
-        newXTRA.inject_xtra_data = oldXTRA->inject_xtra_data;
+        newXTRA.inject_xtra_data = xtra_inject_wrapper;
         return &newXTRA;
     }
-    else if (!strcmp(name, AGPS_INTERFACE) && (oldAGPS = originalGpsInterface->get_extension(name)))
+    else if (!strcmp(name, AGPS_INTERFACE) && legacy_has_extension(name))
     {
         newAGPS.size = sizeof(AGpsInterface);
         newAGPS.init = agps_init_wrapper;
-        newAGPS.data_conn_open = oldAGPS->data_conn_open;
-        newAGPS.data_conn_closed = oldAGPS->data_conn_closed;
-        newAGPS.data_conn_failed = oldAGPS->data_conn_failed;
-        newAGPS.set_server = oldAGPS->set_server;
+        newAGPS.data_conn_open = agps_data_conn_open_wrapper;
+        newAGPS.data_conn_closed = agps_data_conn_closed_wrapper;
+        newAGPS.data_conn_failed = agps_data_conn_failed_wrapper;
+        newAGPS.set_server = agps_set_server_wrapper;
         return &newAGPS;
     }
-    else if (!strcmp(name, AGPS_RIL_INTERFACE) && (oldAGPSRIL = originalGpsInterface->get_extension(name)))
+    else if (!strcmp(name, AGPS_RIL_INTERFACE) && legacy_has_extension(name))
     {
         newAGPSRIL.size = sizeof(AGpsRilInterface);
         newAGPSRIL.init = agpsril_init_wrapper;
-        newAGPSRIL.set_ref_location = oldAGPSRIL->set_ref_location;
-        newAGPSRIL.set_set_id = oldAGPSRIL->set_set_id;
-        newAGPSRIL.ni_message = oldAGPSRIL->ni_message;
+        newAGPSRIL.set_ref_location = agpsril_set_ref_location_wrapper;
+        newAGPSRIL.set_set_id = agpsril_set_set_id_wrapper;
+        newAGPSRIL.ni_message = agpsril_ni_message_wrapper;
         return &newAGPSRIL;
     }
-    /*else if (strcmp(name, GPS_NI_INTERFACE) == 0)
-      {
-      oldNI = originalGpsInterface->get_extension(name);
-      newNI.size = sizeof(GpsNiInterface);
-      newNI.init = oldNI->init;
-      newNI.respond = oldNI->respond;
-      return &newNI;
-      }*/
-
+    else if (!strcmp(name, GPS_NI_INTERFACE) && legacy_has_extension(name))
+    {
+        newNI.size = sizeof(GpsNiInterface);
+        newNI.init = ni_init_wrapper;
+        newNI.respond = ni_respond_wrapper;
+        return &newNI;
+    }
+    else if (!strcmp(name, GPS_SHIM_BATCHING_INTERFACE))
+    {
+        return &shimBatching;
+    }
+    else if (!strcmp(name, GPS_SHIM_STATS_INTERFACE))
+    {
+        return &shimStats;
+    }
+    else if (!strcmp(name, GPS_SHIM_GEOFENCE_INTERFACE))
+    {
+        return &shimGeofence;
+    }
     return NULL;
 }
 
 static int  init_wrapper(GpsCallbacks* callbacks) {
     LOGV("init_wrapper was called");
     static OldGpsCallbacks oldCallbacks;
+    char value[PROPERTY_VALUE_MAX];
+    int n;
+    if (legacy_load())
+        return -1;
     originalCallbacks = callbacks;
+    property_get("persist.gpsshim.nmea_batch", value, "0");
+    nmeaBatching = atoi(value);
+    property_get("persist.gpsshim.nmea_check", value, "1");
+    nmeaCheck = atoi(value);
+    property_get("persist.gpsshim.wakelock_holdoff_ms", value, "100");
+    wakelockHoldOff = atoi(value) < 0 ? 0 : atoi(value);
+    property_get("persist.gpsshim.state", statePath, SHIM_STATE_PATH);
+    property_get("persist.gpsshim.warm_max_age_min", value, "120");
+    warmMaxAge = atoi(value) * 60000LL;
+    property_get("persist.gpsshim.warm_max_accuracy", value, "100");
+    warmMaxAccuracy = atof(value);
+    property_get("persist.gpsshim.change_filter", value, "1");
+    changeFilter = atoi(value);
+    property_get("persist.gpsshim.sv_snr_delta", value, "2.0");
+    svSnrDelta = atof(value);
+    property_get("persist.gpsshim.sv_angle_delta", value, "5.0");
+    svAngleDelta = atof(value);
+    property_get("persist.gpsshim.sv_keepalive_ms", value, "5000");
+    svKeepAlive = atoi(value);
+    property_get("persist.gpsshim.stationary_m", value, "0");
+    fixStationaryRadius = atof(value);
+    property_get("persist.gpsshim.fix_keepalive_ms", value, "10000");
+    fixKeepAlive = atoi(value);
+    property_get("persist.gpsshim.fix_batch_ms", value, "0");
+    batchMaxAge = atoi(value);
+    property_get("persist.gpsshim.fix_batch", value, "0");
+    batchMaxFixes = atoi(value) > SHIM_BATCH_SLOTS / 2 ? SHIM_BATCH_SLOTS / 2 : atoi(value);
+    property_get("persist.gpsshim.stats_file", statsPath, "");
+    property_get("persist.gpsshim.stats_ms", value, "60000");
+    statsInterval = atoi(value);
+    property_get("persist.gpsshim.duty_cycle", value, "60000");
+    schedDutyThreshold = atoi(value);
+    if (!policiesLoaded) {
+        property_get("persist.gpsshim.policy", value, POLICY_PATH);
+        if (value[0] && (n = policy_load(value)) >= 0)
+            LOGI("Loaded %d position mode policies from %s", n, value);
+        policiesLoaded = 1;
+    }
+    /* Directory to record legacy callbacks to, see trace.h */
+    property_get("persist.gpsshim.trace", value, "");
+    if (value[0])
+        trace_start(value);
+    property_get("persist.gpsshim.geofence_cell_m", value, "2000");
+    geofence_init(atof(value));
+    property_get("persist.gpsshim.feed", value, "0");
+    if (atoi(value))
+        feed_start();
     oldCallbacks.location_cb = location_callback_wrapper;
     oldCallbacks.status_cb = status_callback_wrapper;
     oldCallbacks.sv_status_cb = svstatus_callback_wrapper;
     oldCallbacks.nmea_cb = nmea_callback_wrapper;
 #ifdef NO_AGPS
-    originalCallbacks->set_capabilities_cb(0);
+    originalCallbacks->set_capabilities_cb(GPS_CAPABILITY_SCHEDULING|GPS_CAPABILITY_SINGLE_SHOT);
 #else
-    originalCallbacks->set_capabilities_cb(GPS_CAPABILITY_MSB|GPS_CAPABILITY_MSA);
+    originalCallbacks->set_capabilities_cb(GPS_CAPABILITY_SCHEDULING|GPS_CAPABILITY_SINGLE_SHOT|
+                                           GPS_CAPABILITY_MSB|GPS_CAPABILITY_MSA);
 #endif
+    dispatcher_start();
+    sched_start();
     return originalGpsInterface->init(&oldCallbacks);
 }
 
+static void cleanup_wrapper() {
+    /* Producers first, then what they feed, so nothing writes into a torn down sink */
+    sched_stop();
+    originalGpsInterface->cleanup();
+    dispatcher_stop();
+    feed_stop();
+    trace_stop();
+    geofence_cleanup();
+    if (changeFilter)
+        LOGI("Suppressed %u unchanged SV status reports and %u stationary fixes",
+             svSuppressed, fixSuppressed);
+}
+
 static int set_position_mode_wrapper(GpsPositionMode mode, GpsPositionRecurrence recurrence,  uint32_t min_interval, uint32_t preferred_accuracy, uint32_t preferred_time) {
-    return originalGpsInterface->set_position_mode(mode, recurrence ? 0 : (min_interval/1000));
+    const PositionPolicy *policy = policy_lookup(mode, recurrence, min_interval, preferred_accuracy);
+    int frequency;
+
+    pthread_mutex_lock(&schedLock);
+    schedRecurrence = recurrence;
+    schedInterval = min_interval ? min_interval : 1000;
+    schedAccuracy = preferred_accuracy;
+    schedSchedule = policy ? policy->schedule : POLICY_SCHEDULE_AUTO;
+    if (preferred_time)
+        schedLeadTime = preferred_time;
+    else if (policy && policy->lead_time != POLICY_KEEP)
+        schedLeadTime = policy->lead_time;
+    /* When duty cycling, let the engine run at full rate while it is on */
+    frequency = sched_duty_cycling() ? 1 : (recurrence ? 0 : (min_interval/1000));
+    pthread_cond_signal(&schedCond);
+    pthread_mutex_unlock(&schedLock);
+
+    if (policy != NULL) {
+        if (policy->frequency != POLICY_KEEP)
+            frequency = policy->frequency;
+        if (policy->legacy_mode != POLICY_KEEP)
+            mode = policy->legacy_mode;
+        LOGI("Position mode policy from line %d: legacy mode %d, fix every %d s", policy->line,
+             mode, frequency);
+    }
+    return originalGpsInterface->set_position_mode(mode, frequency);
 }
 
 static int stop_wrapper() {
-    int ret = originalGpsInterface->stop();
-    originalCallbacks->release_wakelock_cb();
+    int ret = 0, on;
+
+    pthread_mutex_lock(&engineLock);
+    pthread_mutex_lock(&schedLock);
+    sessionActive = 0;
+    nextStart = 0;
+    stopRequested = 0;
+    on = engineOn;
+    pthread_mutex_unlock(&schedLock);
+    if (on)
+        ret = engine_stop();
+    pthread_mutex_unlock(&engineLock);
+    batch_flush_request();
+    state_save();
+    sched_log_session();
     return ret;
 }
 
 static int start_wrapper() {
-    originalCallbacks->acquire_wakelock_cb();
-    return originalGpsInterface->start();
+    int ret = 0;
+
+    /* A new session compares against nothing from the last one */
+    pthread_mutex_lock(&callbackLock);
+    memset(&fixLast, 0, sizeof(fixLast));
+    fixLastForwarded = 0;
+    pthread_mutex_unlock(&callbackLock);
+
+    pthread_mutex_lock(&engineLock);
+    pthread_mutex_lock(&schedLock);
+    memset(&schedStats, 0, sizeof(schedStats));
+    schedStats.wakelockAcquisitions = wakelockAcquisitions;
+    schedStats.wakelockHeldTime = wakelock_held_time();
+    sessionActive = 1;
+    sessionStarted = now_ms();
+    sessionFirstFix = 0;
+    lastDelivered = 0;
+    nextStart = 0;
+    pthread_mutex_unlock(&schedLock);
+    if (!engineOn) {
+        warmStarted = state_inject();
+        ret = engine_start();
+    }
+    pthread_mutex_unlock(&engineLock);
+    return ret;
+}
+
+static int inject_time_wrapper(GpsUtcTime time, int64_t timeReference, int uncertainty) {
+    if (legacy_load())
+        return -1;
+    return originalGpsInterface->inject_time(time, timeReference, uncertainty);
+}
+
+static int inject_location_wrapper(double latitude, double longitude, float accuracy) {
+    if (legacy_load())
+        return -1;
+    return originalGpsInterface->inject_location(latitude, longitude, accuracy);
+}
+
+static void delete_aiding_data_wrapper(GpsAidingData flags) {
+    if (legacy_load())
+        return;
+    originalGpsInterface->delete_aiding_data(flags);
 }
 
 /* HAL Methods */
 const GpsInterface* gps__get_gps_interface(struct gps_device_t* dev)
 {
+    static pthread_t preloadThread;
+    char value[PROPERTY_VALUE_MAX];
 	LOGV("get_interface was called");
-    originalGpsInterface = gps_get_hardware_interface();
+    property_get("persist.gpsshim.preload", value, "0");
+    legacyPreload = atoi(value);
+    if (legacyPreload && pthread_create(&preloadThread, NULL, legacy_preload, NULL) == 0)
+        pthread_detach(preloadThread);
 
     newGpsInterface.size = sizeof(GpsInterface);
     newGpsInterface.init = init_wrapper;
     newGpsInterface.start = start_wrapper;
     newGpsInterface.stop = stop_wrapper;
-    newGpsInterface.cleanup = originalGpsInterface->cleanup;
-    newGpsInterface.inject_time = originalGpsInterface->inject_time;
-    newGpsInterface.inject_location = originalGpsInterface->inject_location;
-    newGpsInterface.delete_aiding_data = originalGpsInterface->delete_aiding_data;
+    newGpsInterface.cleanup = cleanup_wrapper;
+    newGpsInterface.inject_time = inject_time_wrapper;
+    newGpsInterface.inject_location = inject_location_wrapper;
+    newGpsInterface.delete_aiding_data = delete_aiding_data_wrapper;
     newGpsInterface.set_position_mode = set_position_mode_wrapper;
     newGpsInterface.get_extension = wrapper_get_extension;
 
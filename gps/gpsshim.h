@@ -132,3 +132,49 @@ typedef struct {
 } OldGpsInterface;
 
 
+/** Extensions implemented by the shim itself. */
+
+/* Fix batching */
+#define GPS_SHIM_BATCHING_INTERFACE "gpsshim-batching"
+
+typedef struct {
+    size_t          size;
+    /* max_fixes 0 turns batching off, max_age_ms 0 means no time limit */
+    int  (*set_batching)( int max_fixes, uint32_t max_age_ms );
+    void (*flush)( void );
+} GpsShimBatchingInterface;
+
+/* Event counters and latency histograms */
+#define GPS_SHIM_STATS_INTERFACE "gpsshim-stats"
+
+typedef struct {
+    size_t          size;
+    /* Write the statistics to fd as text, returns 0 on success */
+    int  (*dump)( int fd );
+} GpsShimStatsInterface;
+
+/* Geofencing in the shim: the framework is only called on transitions */
+#define GPS_SHIM_GEOFENCE_INTERFACE "gpsshim-geofence"
+
+#define GPS_SHIM_GEOFENCE_ENTERED   0x1
+#define GPS_SHIM_GEOFENCE_EXITED    0x2
+#define GPS_SHIM_GEOFENCE_DWELL     0x4     /* still inside dwell_ms after entering */
+
+typedef void (* gpsshim_geofence_transition_callback)(int32_t geofence_id, GpsLocation* location,
+                                                      int32_t transition);
+
+typedef struct {
+    gpsshim_geofence_transition_callback transition_cb;
+} GpsShimGeofenceCallbacks;
+
+typedef struct {
+    size_t          size;
+    void (*init)( GpsShimGeofenceCallbacks* callbacks );
+    /* monitor is a mask of GPS_SHIM_GEOFENCE_*; both return -1 if id is in use */
+    int  (*add_circle)( int32_t geofence_id, double latitude, double longitude,
+                        double radius_m, int monitor, uint32_t dwell_ms );
+    /* vertices holds count latitude, longitude pairs */
+    int  (*add_polygon)( int32_t geofence_id, const double* vertices, int count,
+                         int monitor, uint32_t dwell_ms );
+    int  (*remove)( int32_t geofence_id );
+} GpsShimGeofenceInterface;
@@ -0,0 +1,262 @@
+/******************************************************************************
+ * GPS HAL shim - NMEA tokenizer
+ *
+ * Copyright (C) 2012, rondoval
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ ******************************************************************************/
+
+#include <string.h>
+
+#include "nmea.h"
+
+#define NMEA_MAX_FIELDS     24      /* GSV is the longest we decode, 20 fields */
+#define KNOTS_TO_MPS        0.514444f
+
+typedef struct {
+    const char *p;
+    int len;
+} NmeaField;
+
+static int hex_digit(char c) {
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    return -1;
+}
+
+/* Non-negative integer; fails on empty or non-numeric fields */
+static int field_int(const NmeaField *f, int *value) {
+    int i, v = 0;
+
+    if (f->len == 0)
+        return 0;
+    for (i = 0; i < f->len; i++) {
+        if (f->p[i] < '0' || f->p[i] > '9')
+            return 0;
+        v = v * 10 + f->p[i] - '0';
+    }
+    *value = v;
+    return 1;
+}
+
+/* [-]digits[.digits] */
+static int field_decimal(const NmeaField *f, double *value) {
+    const char *p = f->p, *end = f->p + f->len;
+    double v = 0, scale = 1;
+    int negative = 0, digits = 0;
+
+    if (p < end && *p == '-') {
+        negative = 1;
+        p++;
+    }
+    for (; p < end && *p >= '0' && *p <= '9'; p++, digits++)
+        v = v * 10 + *p - '0';
+    if (p < end && *p == '.') {
+        for (p++; p < end && *p >= '0' && *p <= '9'; p++, digits++) {
+            scale *= 0.1;
+            v += (*p - '0') * scale;
+        }
+    }
+    if (p != end || digits == 0)
+        return 0;
+    *value = negative ? -v : v;
+    return 1;
+}
+
+/* hhmmss[.sss] to milliseconds since midnight */
+static int field_time(const NmeaField *f, int32_t *ms) {
+    double v;
+    int hhmmss;
+
+    if (f->len < 6 || !field_decimal(f, &v) || v < 0)
+        return 0;
+    hhmmss = (int)v;
+    *ms = ((hhmmss / 10000) * 3600 + (hhmmss / 100 % 100) * 60 + hhmmss % 100) * 1000 +
+          (int)((v - hhmmss) * 1000 + 0.5);
+    return 1;
+}
+
+/* [d]ddmm.mmmm plus N/S/E/W to signed degrees */
+static int field_coord(const NmeaField *f, const NmeaField *hemisphere, double *degrees) {
+    double v;
+    int whole;
+
+    if (!field_decimal(f, &v) || v < 0 || hemisphere->len != 1)
+        return 0;
+    whole = (int)(v / 100);
+    v = whole + (v - whole * 100) / 60;
+    switch (hemisphere->p[0]) {
+    case 'S':
+    case 'W':
+        v = -v;
+        /* fall through */
+    case 'N':
+    case 'E':
+        *degrees = v;
+        return 1;
+    }
+    return 0;
+}
+
+static int sentence_type(const NmeaField *id) {
+    const char *type = id->p + id->len - 3;
+
+    if (id->len != 5)
+        return NMEA_TYPE_OTHER;
+    if (!memcmp(type, "GGA", 3))
+        return NMEA_TYPE_GGA;
+    if (!memcmp(type, "GSA", 3))
+        return NMEA_TYPE_GSA;
+    if (!memcmp(type, "GSV", 3))
+        return NMEA_TYPE_GSV;
+    if (!memcmp(type, "RMC", 3))
+        return NMEA_TYPE_RMC;
+    if (!memcmp(type, "VTG", 3))
+        return NMEA_TYPE_VTG;
+    if (!memcmp(type, "GLL", 3))
+        return NMEA_TYPE_GLL;
+    return NMEA_TYPE_OTHER;
+}
+
+/* $--GGA,time,lat,N,lon,E,quality,sats,hdop,alt,M,geoid,M,age,station */
+static void decode_gga(const NmeaField *f, int count, NmeaSentence *out) {
+    NmeaGga *gga = &out->u.gga;
+    double v;
+
+    if (count < 10)
+        return;
+    if (field_time(&f[1], &gga->time))
+        out->flags |= NMEA_HAS_TIME;
+    if (!field_int(&f[6], &gga->quality))
+        gga->quality = 0;
+    if (gga->quality && field_coord(&f[2], &f[3], &gga->latitude) &&
+            field_coord(&f[4], &f[5], &gga->longitude))
+        out->flags |= NMEA_HAS_POSITION;
+    if (!field_int(&f[7], &gga->satellites))
+        gga->satellites = 0;
+    if (field_decimal(&f[8], &v)) {
+        gga->hdop = v;
+        out->flags |= NMEA_HAS_HDOP;
+    }
+    if (gga->quality && field_decimal(&f[9], &v)) {
+        gga->altitude = v;
+        out->flags |= NMEA_HAS_ALTITUDE;
+    }
+}
+
+/* $--RMC,time,status,lat,N,lon,E,speed,course,date,magvar,E[,mode] */
+static void decode_rmc(const NmeaField *f, int count, NmeaSentence *out) {
+    NmeaRmc *rmc = &out->u.rmc;
+    double v;
+
+    if (count < 10)
+        return;
+    if (field_time(&f[1], &rmc->time))
+        out->flags |= NMEA_HAS_TIME;
+    rmc->active = f[2].len == 1 && f[2].p[0] == 'A';
+    if (rmc->active && field_coord(&f[3], &f[4], &rmc->latitude) &&
+            field_coord(&f[5], &f[6], &rmc->longitude))
+        out->flags |= NMEA_HAS_POSITION;
+    if (rmc->active && field_decimal(&f[7], &v)) {
+        rmc->speed = v * KNOTS_TO_MPS;
+        out->flags |= NMEA_HAS_SPEED;
+    }
+    if (rmc->active && field_decimal(&f[8], &v)) {
+        rmc->bearing = v;
+        out->flags |= NMEA_HAS_BEARING;
+    }
+    if (field_int(&f[9], &rmc->date))
+        out->flags |= NMEA_HAS_DATE;
+}
+
+/* $--GSV,total,index,in_view{,prn,elevation,azimuth,snr} */
+static void decode_gsv(const NmeaField *f, int count, NmeaSentence *out) {
+    NmeaGsv *gsv = &out->u.gsv;
+    int i;
+
+    if (count < 4 || !field_int(&f[1], &gsv->total) || !field_int(&f[2], &gsv->index) ||
+            !field_int(&f[3], &gsv->in_view))
+        return;
+    gsv->count = 0;
+    for (i = 4; i + 2 < count && gsv->count < NMEA_GSV_PER_SENTENCE; i += 4) {
+        if (!field_int(&f[i], &gsv->sv[gsv->count].prn))
+            continue;
+        if (!field_int(&f[i + 1], &gsv->sv[gsv->count].elevation))
+            gsv->sv[gsv->count].elevation = 0;
+        if (!field_int(&f[i + 2], &gsv->sv[gsv->count].azimuth))
+            gsv->sv[gsv->count].azimuth = 0;
+        /* The snr field is often left empty for satellites not being tracked */
+        if (i + 3 >= count || !field_int(&f[i + 3], &gsv->sv[gsv->count].snr))
+            gsv->sv[gsv->count].snr = -1;
+        gsv->count++;
+    }
+}
+
+int nmea_parse(const char *sentence, int length, NmeaSentence *out) {
+    NmeaField fields[NMEA_MAX_FIELDS];
+    const char *p = sentence + 1, *end = sentence + length;
+    unsigned char sum = 0;
+    int count = 0, hi, lo;
+
+    while (end > sentence && (end[-1] == '\r' || end[-1] == '\n' || end[-1] == '\0'))
+        end--;
+    if (end - sentence < 7 || sentence[0] != '$')
+        return NMEA_ERR_FRAMING;
+
+    /* One pass: checksum and field boundaries together */
+    fields[0].p = p;
+    for (; p < end && *p != '*'; p++) {
+        sum ^= (unsigned char)*p;
+        /* Long proprietary sentences end up with their tail in the last field */
+        if (*p == ',' && count < NMEA_MAX_FIELDS - 1) {
+            fields[count].len = p - fields[count].p;
+            fields[++count].p = p + 1;
+        }
+    }
+    fields[count].len = p - fields[count].p;
+    count++;
+
+    memset(out, 0, sizeof(*out));
+    if (p < end) {
+        if (end - p != 3 || (hi = hex_digit(p[1])) < 0 || (lo = hex_digit(p[2])) < 0 ||
+                ((hi << 4) | lo) != sum)
+            return NMEA_ERR_CHECKSUM;
+        out->flags |= NMEA_HAS_CHECKSUM;
+    }
+
+    if (fields[0].len < 3)
+        return NMEA_ERR_FRAMING;
+    out->type = sentence_type(&fields[0]);
+    if (fields[0].len == 5) {
+        out->talker[0] = fields[0].p[0];
+        out->talker[1] = fields[0].p[1];
+    }
+
+    switch (out->type) {
+    case NMEA_TYPE_GGA:
+        decode_gga(fields, count, out);
+        break;
+    case NMEA_TYPE_RMC:
+        decode_rmc(fields, count, out);
+        break;
+    case NMEA_TYPE_GSV:
+        decode_gsv(fields, count, out);
+        break;
+    }
+    return NMEA_OK;
+}
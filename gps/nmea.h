@@ -0,0 +1,110 @@
+/******************************************************************************
+ * GPS HAL shim - NMEA tokenizer
+ *
+ * Copyright (C) 2012, rondoval
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ ******************************************************************************/
+
+#ifndef GPSSHIM_NMEA_H
+#define GPSSHIM_NMEA_H
+
+#include <stdint.h>
+
+/* Sentence types, usable as a bitmask */
+enum {
+    NMEA_TYPE_GGA   = 0x01,
+    NMEA_TYPE_GSA   = 0x02,
+    NMEA_TYPE_GSV   = 0x04,
+    NMEA_TYPE_RMC   = 0x08,
+    NMEA_TYPE_VTG   = 0x10,
+    NMEA_TYPE_GLL   = 0x20,
+    NMEA_TYPE_OTHER = 0x40,
+};
+
+/* nmea_parse() results */
+enum {
+    NMEA_OK             = 0,
+    NMEA_ERR_FRAMING    = -1,   /* no leading '$' or no sentence id */
+    NMEA_ERR_CHECKSUM   = -2,   /* checksum present but wrong or unreadable */
+};
+
+/* NmeaSentence.flags: which of the parsed fields carry a value */
+enum {
+    NMEA_HAS_CHECKSUM   = 0x01,
+    NMEA_HAS_TIME       = 0x02,
+    NMEA_HAS_POSITION   = 0x04,
+    NMEA_HAS_ALTITUDE   = 0x08,
+    NMEA_HAS_HDOP       = 0x10,
+    NMEA_HAS_SPEED      = 0x20,
+    NMEA_HAS_BEARING    = 0x40,
+    NMEA_HAS_DATE       = 0x80,
+};
+
+#define NMEA_GSV_PER_SENTENCE   4
+
+typedef struct {
+    int32_t time;           /* UTC milliseconds since midnight */
+    double  latitude;       /* degrees, south is negative */
+    double  longitude;      /* degrees, west is negative */
+    int     quality;        /* 0 means no fix */
+    int     satellites;
+    float   hdop;
+    float   altitude;       /* meters above mean sea level */
+} NmeaGga;
+
+typedef struct {
+    int32_t time;           /* UTC milliseconds since midnight */
+    int     active;         /* status 'A' */
+    double  latitude;
+    double  longitude;
+    float   speed;          /* meters per second */
+    float   bearing;        /* degrees true */
+    int     date;           /* ddmmyy */
+} NmeaRmc;
+
+typedef struct {
+    int     total;          /* sentences in this GSV group */
+    int     index;          /* 1 based */
+    int     in_view;
+    int     count;          /* valid entries in sv */
+    struct {
+        int prn;
+        int elevation;
+        int azimuth;
+        int snr;            /* -1 when not tracked */
+    } sv[NMEA_GSV_PER_SENTENCE];
+} NmeaGsv;
+
+typedef struct {
+    int      type;          /* NMEA_TYPE_* */
+    char     talker[3];     /* "GP", "GL"... */
+    uint32_t flags;         /* NMEA_HAS_* */
+    union {
+        NmeaGga gga;
+        NmeaRmc rmc;
+        NmeaGsv gsv;
+    } u;
+} NmeaSentence;
+
+/*
+ * Validate and tokenize one sentence in a single pass over the caller's
+ * buffer: nothing is copied or allocated, and the buffer need not be NUL
+ * terminated. Trailing CR/LF is ignored. GGA, RMC and GSV fields are decoded
+ * into out; other sentence types only get type and talker. A sentence
+ * without a checksum is accepted, one with a wrong checksum is not.
+ */
+int nmea_parse(const char *sentence, int length, NmeaSentence *out);
+
+#endif
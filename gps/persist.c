@@ -0,0 +1,99 @@
+/******************************************************************************
+ * GPS HAL shim - persistent files
+ *
+ * Copyright (C) 2012, rondoval
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ ******************************************************************************/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#define LOG_TAG "gps-shim"
+#include <utils/Log.h>
+
+#include "persist.h"
+
+int write_fully(int fd, const void *data, size_t length) {
+    const char *p = data;
+    ssize_t written;
+
+    while (length) {
+        written = write(fd, p, length);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += written;
+        length -= written;
+    }
+    return 0;
+}
+
+int persist_replace(const char *path, const void *header, size_t header_length,
+                    const void *data, size_t length) {
+    char tmp[256];
+    int fd;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) {
+        LOGW("Could not create %s: %s", tmp, strerror(errno));
+        return -1;
+    }
+    if (write_fully(fd, header, header_length) || write_fully(fd, data, length) || fsync(fd)) {
+        LOGW("Could not write %s: %s", tmp, strerror(errno));
+        close(fd);
+        unlink(tmp);
+        return -1;
+    }
+    close(fd);
+
+    if (rename(tmp, path)) {
+        LOGW("Could not replace %s: %s", path, strerror(errno));
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+int persist_read(const char *path, void *buffer, size_t length) {
+    char *p = buffer;
+    ssize_t got;
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0)
+        return -1;
+    while (length) {
+        got = read(fd, p, length);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got <= 0)
+            break;
+        p += got;
+        length -= got;
+    }
+    close(fd);
+    return length ? -1 : 0;
+}
+
+int64_t wall_time_ms() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (int64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
@@ -0,0 +1,42 @@
+/******************************************************************************
+ * GPS HAL shim - persistent files
+ *
+ * Copyright (C) 2012, rondoval
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ ******************************************************************************/
+
+#ifndef GPSSHIM_PERSIST_H
+#define GPSSHIM_PERSIST_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+int write_fully(int fd, const void *data, size_t length);
+
+/*
+ * Replace path with header followed by data (either may be empty), through
+ * a temporary file that is synced and renamed over it, so readers never see
+ * a partial file. Returns 0 on success.
+ */
+int persist_replace(const char *path, const void *header, size_t header_length,
+                    const void *data, size_t length);
+
+/* Read exactly length bytes from the start of path. Returns 0 on success. */
+int persist_read(const char *path, void *buffer, size_t length);
+
+/* Wall clock in milliseconds since the epoch */
+int64_t wall_time_ms();
+
+#endif
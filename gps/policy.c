@@ -0,0 +1,171 @@
+/******************************************************************************
+ * GPS HAL shim - position mode policies
+ *
+ * Copyright (C) 2012, rondoval
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ ******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#define LOG_TAG "gps-shim"
+#include <utils/Log.h>
+#include <hardware/gps.h>
+
+#include "policy.h"
+
+static PositionPolicy policies[POLICY_MAX];
+static int policyCount = 0;
+
+/* wildcard ("*" or "=") stands for POLICY_ANY or POLICY_KEEP, the same value */
+static int parse_mode(const char *s, const char *wildcard, int *mode) {
+    if (!strcmp(s, "standalone"))
+        *mode = GPS_POSITION_MODE_STANDALONE;
+    else if (!strcmp(s, "ms_based"))
+        *mode = GPS_POSITION_MODE_MS_BASED;
+    else if (!strcmp(s, "ms_assisted"))
+        *mode = GPS_POSITION_MODE_MS_ASSISTED;
+    else if (!strcmp(s, wildcard))
+        *mode = POLICY_ANY;
+    else
+        return 0;
+    return 1;
+}
+
+static int parse_recurrence(const char *s, int *recurrence) {
+    if (!strcmp(s, "periodic"))
+        *recurrence = GPS_POSITION_RECURRENCE_PERIODIC;
+    else if (!strcmp(s, "single"))
+        *recurrence = GPS_POSITION_RECURRENCE_SINGLE;
+    else if (!strcmp(s, "*"))
+        *recurrence = POLICY_ANY;
+    else
+        return 0;
+    return 1;
+}
+
+/* n, lo-hi, lo+ or * */
+static int parse_range(const char *s, uint32_t *lo, uint32_t *hi) {
+    char *end;
+
+    if (!strcmp(s, "*")) {
+        *lo = 0;
+        *hi = UINT32_MAX;
+        return 1;
+    }
+    *lo = strtoul(s, &end, 10);
+    if (end == s)
+        return 0;
+    if (*end == '\0') {
+        *hi = *lo;
+        return 1;
+    }
+    if (!strcmp(end, "+")) {
+        *hi = UINT32_MAX;
+        return 1;
+    }
+    if (*end != '-' || end[1] < '0' || end[1] > '9')
+        return 0;
+    *hi = strtoul(end + 1, &end, 10);
+    return *end == '\0' && *lo <= *hi;
+}
+
+/* A non-negative number or '=' */
+static int parse_keep(const char *s, int *value) {
+    char *end;
+    long v;
+
+    if (!strcmp(s, "=")) {
+        *value = POLICY_KEEP;
+        return 1;
+    }
+    v = strtol(s, &end, 10);
+    if (end == s || *end != '\0' || v < 0 || v > 86400000)
+        return 0;
+    *value = v;
+    return 1;
+}
+
+static int parse_schedule(const char *s, int *schedule) {
+    if (!strcmp(s, "auto"))
+        *schedule = POLICY_SCHEDULE_AUTO;
+    else if (!strcmp(s, "cycle"))
+        *schedule = POLICY_SCHEDULE_CYCLE;
+    else if (!strcmp(s, "on"))
+        *schedule = POLICY_SCHEDULE_ON;
+    else
+        return 0;
+    return 1;
+}
+
+int policy_load(const char *path) {
+    char line[256], field[8][32], *comment;
+    PositionPolicy *policy;
+    FILE *file;
+    int n, number = 0;
+
+    policyCount = 0;
+    file = fopen(path, "r");
+    if (file == NULL)
+        return -1;
+
+    while (fgets(line, sizeof(line), file) != NULL) {
+        number++;
+        if ((comment = strchr(line, '#')) != NULL)
+            *comment = '\0';
+        n = sscanf(line, "%31s %31s %31s %31s %31s %31s %31s %31s", field[0], field[1],
+                   field[2], field[3], field[4], field[5], field[6], field[7]);
+        if (n <= 0)
+            continue;
+        if (policyCount == POLICY_MAX) {
+            LOGW("%s:%d: more than %d policies, ignoring the rest", path, number, POLICY_MAX);
+            break;
+        }
+
+        policy = &policies[policyCount];
+        policy->lead_time = POLICY_KEEP;
+        policy->line = number;
+        if (n < 7 || !parse_mode(field[0], "*", &policy->mode) ||
+                !parse_recurrence(field[1], &policy->recurrence) ||
+                !parse_range(field[2], &policy->interval_min, &policy->interval_max) ||
+                !parse_range(field[3], &policy->accuracy_min, &policy->accuracy_max) ||
+                !parse_mode(field[4], "=", &policy->legacy_mode) ||
+                !parse_keep(field[5], &policy->frequency) ||
+                !parse_schedule(field[6], &policy->schedule) ||
+                (n == 8 && !parse_keep(field[7], &policy->lead_time))) {
+            LOGW("%s:%d: malformed policy, skipped", path, number);
+            continue;
+        }
+        policyCount++;
+    }
+    fclose(file);
+    return policyCount;
+}
+
+const PositionPolicy* policy_lookup(int mode, int recurrence, uint32_t interval,
+                                    uint32_t accuracy) {
+    const PositionPolicy *policy;
+    int i;
+
+    for (i = 0; i < policyCount; i++) {
+        policy = &policies[i];
+        if ((policy->mode == POLICY_ANY || policy->mode == mode) &&
+                (policy->recurrence == POLICY_ANY || policy->recurrence == recurrence) &&
+                interval >= policy->interval_min && interval <= policy->interval_max &&
+                accuracy >= policy->accuracy_min && accuracy <= policy->accuracy_max)
+            return policy;
+    }
+    return NULL;
+}
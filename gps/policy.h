@@ -0,0 +1,83 @@
+/******************************************************************************
+ * GPS HAL shim - position mode policies
+ *
+ * Copyright (C) 2012, rondoval
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ ******************************************************************************/
+
+#ifndef GPSSHIM_POLICY_H
+#define GPSSHIM_POLICY_H
+
+#include <stdint.h>
+
+/*
+ * Position mode policies map what the framework asks for in
+ * set_position_mode() to what the legacy library is told and how the shim
+ * schedules the engine. They are read once, at init, from a text file with
+ * one rule per line; the first rule matching a request applies, and a
+ * request no rule matches is handled as if there were no file.
+ *
+ *   # mode     recurrence  interval_ms   accuracy_m  legacy_mode  frequency_s  schedule  [lead_ms]
+ *   *          single      *             *           ms_based     1            on
+ *   *          periodic    300000+       100+        standalone   1            cycle     15000
+ *   ms_based   periodic    1000-9999     0-50        =            1            on
+ *
+ * mode and legacy_mode are standalone, ms_based or ms_assisted, recurrence
+ * is periodic or single. Intervals and accuracies are n, lo-hi or lo+, both
+ * ends included; the framework asks for accuracy 0 when it has no
+ * preference. '*' matches anything, '=' keeps what the shim would have used
+ * without a policy. lead_ms seeds the time the engine is restarted ahead of
+ * a duty cycled fix, unless the framework asked for a preferred time; it is
+ * still learned from there. Schedules:
+ *
+ *   auto   stop the engine between fixes from persist.gpsshim.duty_cycle on
+ *   cycle  stop it between fixes whenever the interval leaves room to
+ *   on     keep it running for the whole session
+ *
+ * Anything after a '#' is a comment.
+ */
+#define POLICY_ANY      -1
+#define POLICY_KEEP     -1
+#define POLICY_MAX      32
+
+enum {
+    POLICY_SCHEDULE_AUTO,
+    POLICY_SCHEDULE_CYCLE,
+    POLICY_SCHEDULE_ON,
+};
+
+typedef struct {
+    int      mode;          /* GpsPositionMode or POLICY_ANY */
+    int      recurrence;    /* GpsPositionRecurrence or POLICY_ANY */
+    uint32_t interval_min, interval_max;
+    uint32_t accuracy_min, accuracy_max;
+    int      legacy_mode;   /* GpsPositionMode or POLICY_KEEP */
+    int      frequency;     /* seconds or POLICY_KEEP */
+    int      schedule;      /* POLICY_SCHEDULE_* */
+    int      lead_time;     /* ms or POLICY_KEEP */
+    int      line;          /* in the file, for logging */
+} PositionPolicy;
+
+/*
+ * Replace the table with the rules in path. Malformed lines are logged and
+ * skipped. Returns the number of rules loaded, or -1 if path can't be read.
+ */
+int policy_load(const char *path);
+
+/* The first rule matching a request, or NULL */
+const PositionPolicy* policy_lookup(int mode, int recurrence, uint32_t interval,
+                                    uint32_t accuracy);
+
+#endif
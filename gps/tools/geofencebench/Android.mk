@@ -0,0 +1,25 @@
+LOCAL_PATH := $(call my-dir)
+include $(CLEAR_VARS)
+
+# Host benchmark of the shim's geofence engine
+
+LOCAL_MODULE := gpsshim_geofence_bench
+LOCAL_MODULE_TAGS := optional
+
+LOCAL_SRC_FILES := \
+    ../../geofence.c \
+    geofencebench.c
+
+LOCAL_C_INCLUDES += \
+    $(LOCAL_PATH)/../..
+
+LOCAL_STATIC_LIBRARIES := \
+    libcutils \
+    liblog
+
+LOCAL_CFLAGS += \
+    -fno-short-enums
+
+LOCAL_LDLIBS += -lpthread -lrt -lm
+
+include $(BUILD_HOST_EXECUTABLE)
@@ -0,0 +1,201 @@
+/******************************************************************************
+ * GPS HAL shim - geofence benchmark
+ *
+ * Copyright (C) 2012, rondoval
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ ******************************************************************************/
+
+
+/*
+ * Registers a growing number of random fences (circles and hexagons of 50m
+ * to 500m) over a 50km square and drives a receiver through it, measuring
+ * fixes tested per second with the grid index and with a single cell, which
+ * amounts to testing every fence. Both must report the same transitions.
+ * A few fixed probes around fences across the antimeridian come first.
+ *
+ *   gpsshim_geofence_bench [-n max fences] [-f fixes] [-c cell m]
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <gpsshim.h>
+#include "geofence.h"
+
+#define AREA_LATITUDE       48.1
+#define AREA_LONGITUDE      11.5
+#define AREA_SIZE           50000.0     /* m */
+#define METERS_PER_DEGREE   111320.0
+#define SINGLE_CELL         4e7         /* m, the whole world */
+
+static uint32_t transitions = 0;
+
+static void count_transition(int32_t id, int32_t transition, const GpsLocation *location) {
+    transitions++;
+}
+
+static double now_s() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double random_range(double low, double high) {
+    return low + (high - low) * rand() / RAND_MAX;
+}
+
+static void add_fences(int count) {
+    double cosLatitude = cos(AREA_LATITUDE * M_PI / 180);
+    double latitude, longitude, radius, vertices[12];
+    int i, v;
+
+    for (i = 0; i < count; i++) {
+        latitude = AREA_LATITUDE + random_range(0, AREA_SIZE) / METERS_PER_DEGREE;
+        longitude = AREA_LONGITUDE + random_range(0, AREA_SIZE) / METERS_PER_DEGREE / cosLatitude;
+        radius = random_range(50, 500);
+        if (i % 5) {
+            geofence_add_circle(i, latitude, longitude, radius, GPS_SHIM_GEOFENCE_ENTERED |
+                                GPS_SHIM_GEOFENCE_EXITED | GPS_SHIM_GEOFENCE_DWELL, 60000);
+            continue;
+        }
+        for (v = 0; v < 6; v++) {
+            vertices[2 * v] = latitude + radius * sin(v * M_PI / 3) / METERS_PER_DEGREE;
+            vertices[2 * v + 1] = longitude + radius * cos(v * M_PI / 3) / METERS_PER_DEGREE /
+                                  cosLatitude;
+        }
+        geofence_add_polygon(i, vertices, 6, GPS_SHIM_GEOFENCE_ENTERED | GPS_SHIM_GEOFENCE_EXITED,
+                             0);
+    }
+}
+
+/* Does a fix at latitude, longitude enter the one fence registered? */
+static int probe(double latitude, double longitude) {
+    GpsLocation location;
+
+    memset(&location, 0, sizeof(location));
+    location.size = sizeof(location);
+    location.flags = GPS_LOCATION_HAS_LAT_LONG;
+    location.latitude = latitude;
+    location.longitude = longitude;
+    transitions = 0;
+    geofence_update(&location, count_transition);
+    return transitions;
+}
+
+/* A circle and a square straddling 180 degrees, probed on both sides of it; returns failures */
+static int check_antimeridian() {
+    static const struct { double latitude, longitude; int inside; } probes[] = {
+        { 0, 179.95, 1 }, { 0, -179.95, 1 }, { 0, 180, 1 }, { 0.05, -179.92, 1 },
+        { 0, 179.8, 0 }, { 0, -179.8, 0 }, { 0, 0, 0 }, { 0.3, 180, 0 },
+    };
+    static const double square[] = { -0.1, 179.9, -0.1, -179.9, 0.1, -179.9, 0.1, 179.9 };
+    int i, shape, failures = 0;
+
+    for (shape = 0; shape < 2; shape++) {
+        for (i = 0; i < (int)(sizeof(probes) / sizeof(probes[0])); i++) {
+            geofence_init(2000);
+            if (shape == 0)
+                geofence_add_circle(1, 0, 180, 15000, GPS_SHIM_GEOFENCE_ENTERED, 0);
+            else
+                geofence_add_polygon(1, square, 4, GPS_SHIM_GEOFENCE_ENTERED, 0);
+            if (probe(probes[i].latitude, probes[i].longitude) != probes[i].inside) {
+                printf("antimeridian %s: %.2f,%.2f should be %s\n", shape ? "square" : "circle",
+                       probes[i].latitude, probes[i].longitude,
+                       probes[i].inside ? "inside" : "outside");
+                failures++;
+            }
+            geofence_cleanup();
+        }
+    }
+    return failures;
+}
+
+/* Returns fixes per second, fills in fences tested per fix and transitions */
+static double run(int fences, int fixes, double cell, double *tested, uint32_t *seen) {
+    double cosLatitude = cos(AREA_LATITUDE * M_PI / 180);
+    double x = AREA_SIZE / 2, y = AREA_SIZE / 2, heading = 0, begin, elapsed;
+    uint64_t total = 0;
+    GpsLocation location;
+    int i;
+
+    srand(fences);
+    geofence_init(cell);
+    add_fences(fences);
+    transitions = 0;
+
+    memset(&location, 0, sizeof(location));
+    location.size = sizeof(location);
+    location.flags = GPS_LOCATION_HAS_LAT_LONG | GPS_LOCATION_HAS_ACCURACY;
+    begin = now_s();
+    for (i = 0; i < fixes; i++) {
+        /* Driving at 15m/s, turning now and then, bouncing off the edges */
+        heading += random_range(-0.2, 0.2);
+        x += 15 * cos(heading);
+        y += 15 * sin(heading);
+        if (x < 0 || x > AREA_SIZE || y < 0 || y > AREA_SIZE) {
+            heading += M_PI;
+            x = x < 0 ? 0 : x > AREA_SIZE ? AREA_SIZE : x;
+            y = y < 0 ? 0 : y > AREA_SIZE ? AREA_SIZE : y;
+        }
+        location.latitude = AREA_LATITUDE + y / METERS_PER_DEGREE;
+        location.longitude = AREA_LONGITUDE + x / METERS_PER_DEGREE / cosLatitude;
+        location.accuracy = random_range(3, 30);
+        location.timestamp = i * 1000LL;
+        total += geofence_update(&location, count_transition);
+    }
+    elapsed = now_s() - begin;
+    geofence_cleanup();
+
+    *tested = (double)total / fixes;
+    *seen = transitions;
+    return fixes / elapsed;
+}
+
+int main(int argc, char **argv) {
+    int maxFences = 10000, fixes = 100000, fences, opt;
+    double cell = 2000, gridRate, linearRate, gridTested, linearTested;
+    uint32_t gridTransitions, linearTransitions;
+
+    while ((opt = getopt(argc, argv, "n:f:c:")) != -1) {
+        switch (opt) {
+        case 'n': maxFences = atoi(optarg); break;
+        case 'f': fixes = atoi(optarg); break;
+        case 'c': cell = atof(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-n max fences] [-f fixes] [-c cell m]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (check_antimeridian()) {
+        printf("FAIL: fences across the antimeridian\n");
+        return 1;
+    }
+    printf("%d fixes per run, %.0fm cells\n", fixes, cell);
+    printf("%8s %14s %10s %14s %10s %11s\n", "fences", "grid fixes/s", "tested", "all fixes/s",
+           "tested", "transitions");
+    for (fences = 10; fences <= maxFences; fences *= 10) {
+        gridRate = run(fences, fixes, cell, &gridTested, &gridTransitions);
+        linearRate = run(fences, fixes, SINGLE_CELL, &linearTested, &linearTransitions);
+        printf("%8d %14.0f %10.1f %14.0f %10.1f %11u%s\n", fences, gridRate, gridTested,
+               linearRate, linearTested, gridTransitions,
+               gridTransitions == linearTransitions ? "" : " MISMATCH");
+    }
+    return 0;
+}
@@ -0,0 +1,33 @@
+LOCAL_PATH := $(call my-dir)
+include $(CLEAR_VARS)
+
+# Host benchmark: the shim on top of a synthetic legacy library
+
+LOCAL_MODULE := gpsshim_bench
+LOCAL_MODULE_TAGS := optional
+
+LOCAL_SRC_FILES := \
+    ../../gps.c \
+    ../../nmea.c \
+    ../../persist.c \
+    ../../xtra_cache.c \
+    ../../trace.c \
+    ../../feed.c \
+    ../../geofence.c \
+    ../../policy.c \
+    synthetic_gps.c \
+    gpsbench.c
+
+LOCAL_C_INCLUDES += \
+    $(LOCAL_PATH)/../..
+
+LOCAL_STATIC_LIBRARIES := \
+    libcutils \
+    liblog
+
+LOCAL_CFLAGS += \
+    -fno-short-enums
+
+LOCAL_LDLIBS += -lpthread -lrt -lm
+
+include $(BUILD_HOST_EXECUTABLE)
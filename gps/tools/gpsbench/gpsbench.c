@@ -0,0 +1,324 @@
+/******************************************************************************
+ * GPS HAL shim - callback throughput benchmark
+ *
+ * Copyright (C) 2012, rondoval
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ ******************************************************************************/
+
+/*
+ * Loads the shim on top of the synthetic legacy library and measures what
+ * comes out on the framework side: throughput, delivery latency from the
+ * legacy callback to the framework callback, ordering and loss.
+ *
+ *   gpsshim_bench [-r epochs/s] [-n nmea/epoch] [-a aux events/s] [-d seconds] [-w us] [-b fixes]
+ *   gpsshim_bench -t trace [-s speed] [-d seconds] [-w us] [-b fixes]
+ *
+ * -w makes every framework callback take that long, like a framework under
+ * memory pressure, to see what the shim keeps and drops.
+ *
+ * -b switches fix batching of that many fixes on and off every 100 ms from
+ * the main thread, the way the framework would; the run fails if fixes then
+ * reach the framework out of order.
+ *
+ * The second form replays a trace recorded on a device with
+ * persist.gpsshim.trace, at speed times the original pace (0 for as fast as
+ * possible), until it ends or for at most the given time. "Lost" then
+ * includes what the shim filtered or throttled on purpose.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <hardware/gps.h>
+#include <gpsshim.h>
+#include "synthetic_gps.h"
+
+#define MAX_SAMPLES     (1 << 20)
+
+typedef struct {
+    const char *name;
+    int id;                 /* SYNTHETIC_* */
+    uint32_t delivered;
+    uint32_t reordered;
+    uint32_t unknown;       /* send time no longer in the synthetic log */
+    uint32_t last;          /* key of the last delivery */
+    uint32_t samples;
+    int32_t *latency;       /* microseconds */
+} Channel;
+
+static Channel locations = { "location", SYNTHETIC_LOCATION };
+static Channel svStatus = { "sv status", SYNTHETIC_SV_STATUS };
+static Channel nmea = { "nmea", SYNTHETIC_NMEA };
+static uint32_t statusReports = 0;
+static uint32_t auxDelivered = 0;
+static const GpsNiInterface *ni = NULL;
+static int wakelockAcquired = 0;
+static int wakelockHeld = 0;
+static int sinkDelay = 0;           /* us spent in each framework callback */
+static int batchToggle = 0;         /* fixes per batch, 0 to leave batching alone */
+
+static void sink_stall() {
+    int64_t until;
+
+    if (!sinkDelay)
+        return;
+    until = synthetic_now_ns() + sinkDelay * 1000LL;
+    while (synthetic_now_ns() < until)
+        ;
+}
+
+static void channel_record(Channel *channel, uint32_t key, int count) {
+    int64_t sent = synthetic_gps_sent(channel->id, key);
+
+    if (channel->delivered && (int32_t)(key - channel->last) < 0)
+        channel->reordered++;
+    channel->last = key;
+    channel->delivered += count;
+    if (!sent) {
+        channel->unknown++;
+        return;
+    }
+    if (channel->samples < MAX_SAMPLES)
+        channel->latency[channel->samples++] = (synthetic_now_ns() - sent) / 1000;
+    sink_stall();
+}
+
+static void sink_location(GpsLocation *location) {
+    channel_record(&locations, location->timestamp, 1);
+}
+
+static void sink_status(GpsStatus *status) {
+    statusReports++;
+    sink_stall();
+}
+
+static void sink_sv_status(GpsSvStatus *sv_info) {
+    channel_record(&svStatus, sv_info->almanac_mask, 1);
+}
+
+static void sink_nmea(GpsUtcTime timestamp, const char *sentence, int length) {
+    int i, count = 0;
+
+    /* Batched epochs carry several sentences */
+    for (i = 0; i < length; i++)
+        if (sentence[i] == '$')
+            count++;
+    channel_record(&nmea, timestamp, count);
+}
+
+static void sink_set_capabilities(uint32_t capabilities) {
+    printf("capabilities 0x%x\n", capabilities);
+}
+
+static void sink_acquire_wakelock() {
+    wakelockAcquired++;
+    wakelockHeld++;
+}
+
+static void sink_release_wakelock() {
+    wakelockHeld--;
+}
+
+typedef struct {
+    void (*start)(void *);
+    void *arg;
+} ThreadStart;
+
+static void* sink_thread_trampoline(void *p) {
+    ThreadStart start = *(ThreadStart *)p;
+    free(p);
+    start.start(start.arg);
+    return NULL;
+}
+
+/* Detached, like the framework's Java threads: the shim must never join them */
+static pthread_t sink_create_thread(const char *name, void (*start)(void *), void *arg) {
+    pthread_t thread;
+    pthread_attr_t attr;
+    ThreadStart *s = malloc(sizeof(*s));
+
+    s->start = start;
+    s->arg = arg;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_create(&thread, &attr, sink_thread_trampoline, s);
+    pthread_attr_destroy(&attr);
+    return thread;
+}
+
+static void sink_agps_status(AGpsStatus *status) {
+    auxDelivered++;
+}
+
+static void sink_xtra_download() {
+    auxDelivered++;
+}
+
+static void sink_agpsril_request(uint32_t flags) {
+    auxDelivered++;
+}
+
+/* A user who accepts at once, so the shim times its own share of the round trip */
+static void sink_ni_notify(GpsNiNotification *notification) {
+    auxDelivered++;
+    ni->respond(notification->notification_id, GPS_NI_RESPONSE_ACCEPT);
+}
+
+static GpsCallbacks sinkCallbacks = {
+    sizeof(GpsCallbacks),
+    sink_location,
+    sink_status,
+    sink_sv_status,
+    sink_nmea,
+    sink_set_capabilities,
+    sink_acquire_wakelock,
+    sink_release_wakelock,
+    sink_create_thread,
+};
+
+static AGpsCallbacks sinkAGpsCallbacks = {
+    sink_agps_status,
+    sink_create_thread,
+};
+
+static GpsXtraCallbacks sinkXtraCallbacks = {
+    sink_xtra_download,
+    sink_create_thread,
+};
+
+static AGpsRilCallbacks sinkAGpsRilCallbacks = {
+    sink_agpsril_request,
+    sink_agpsril_request,
+    sink_create_thread,
+};
+
+static GpsNiCallbacks sinkNiCallbacks = {
+    sink_ni_notify,
+    sink_create_thread,
+};
+
+static int compare_int32(const void *a, const void *b) {
+    return *(const int32_t *)a - *(const int32_t *)b;
+}
+
+static void channel_report(Channel *channel, uint32_t sent) {
+    int32_t *l = channel->latency;
+    uint32_t n = channel->samples;
+
+    qsort(l, n, sizeof(int32_t), compare_int32);
+    printf("%-10s delivered %8u of %8u, lost %6d, reordered %u",
+           channel->name, channel->delivered, sent, (int)(sent - channel->delivered),
+           channel->reordered);
+    if (n)
+        printf(", latency us: p50 %d p90 %d p99 %d max %d", l[n / 2], l[n * 9 / 10],
+               l[n * 99 / 100], l[n - 1]);
+    printf("\n");
+}
+
+int main(int argc, char **argv) {
+    extern const struct hw_module_t HAL_MODULE_INFO_SYM;
+    SyntheticGpsConfig config = { 1000, 4, 10, NULL, 1 };
+    struct gps_device_t *device;
+    const GpsInterface *gps;
+    const AGpsInterface *agps;
+    const GpsXtraInterface *xtra;
+    const AGpsRilInterface *agpsril;
+    const GpsShimStatsInterface *stats;
+    const GpsShimBatchingInterface *batching = NULL;
+    int seconds = -1, opt, toggles = 0;
+    int64_t begin, elapsed;
+
+    while ((opt = getopt(argc, argv, "r:n:a:d:t:s:w:b:")) != -1) {
+        switch (opt) {
+        case 'r': config.rate = atoi(optarg); break;
+        case 'n': config.nmea_per_epoch = atoi(optarg); break;
+        case 'a': config.aux_rate = atoi(optarg); break;
+        case 'd': seconds = atoi(optarg); break;
+        case 't': config.trace = optarg; break;
+        case 's': config.speed = atof(optarg); break;
+        case 'w': sinkDelay = atoi(optarg); break;
+        case 'b': batchToggle = atoi(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-r epochs/s] [-n nmea/epoch] [-a aux/s] [-d seconds] [-w us] [-b fixes]\n"
+                    "       %s -t trace [-s speed] [-d seconds] [-w us] [-b fixes]\n", argv[0], argv[0]);
+            return 1;
+        }
+    }
+    if (seconds < 0)
+        seconds = config.trace != NULL ? 24 * 3600 : 5;
+    if (synthetic_gps_configure(&config))
+        return 1;
+    locations.latency = malloc(MAX_SAMPLES * sizeof(int32_t));
+    svStatus.latency = malloc(MAX_SAMPLES * sizeof(int32_t));
+    nmea.latency = malloc(MAX_SAMPLES * sizeof(int32_t));
+
+    if (HAL_MODULE_INFO_SYM.methods->open(&HAL_MODULE_INFO_SYM, GPS_HARDWARE_MODULE_ID,
+                                          (struct hw_device_t **)&device))
+        return 1;
+    gps = device->get_gps_interface(device);
+    gps->init(&sinkCallbacks);
+    if ((agps = gps->get_extension(AGPS_INTERFACE)) != NULL)
+        agps->init(&sinkAGpsCallbacks);
+    if ((xtra = gps->get_extension(GPS_XTRA_INTERFACE)) != NULL)
+        xtra->init(&sinkXtraCallbacks);
+    if ((agpsril = gps->get_extension(AGPS_RIL_INTERFACE)) != NULL)
+        agpsril->init(&sinkAGpsRilCallbacks);
+    if ((ni = gps->get_extension(GPS_NI_INTERFACE)) != NULL)
+        ni->init(&sinkNiCallbacks);
+    if (batchToggle && (batching = gps->get_extension(GPS_SHIM_BATCHING_INTERFACE)) == NULL) {
+        fprintf(stderr, "no batching extension\n");
+        return 1;
+    }
+
+    gps->set_position_mode(GPS_POSITION_MODE_MS_BASED, GPS_POSITION_RECURRENCE_PERIODIC, 1, 0, 0);
+    gps->start();
+    begin = synthetic_now_ns();
+    do {
+        usleep(100000);
+        elapsed = synthetic_now_ns() - begin;
+        if (batching != NULL)
+            batching->set_batching(++toggles & 1 ? batchToggle : 0, 0);
+    } while (elapsed < seconds * 1000000000LL && !synthetic_gps_done());
+    gps->stop();
+    usleep(200000);
+    /* The shim's own view, before cleanup stops the dispatcher */
+    if ((stats = gps->get_extension(GPS_SHIM_STATS_INTERFACE)) != NULL)
+        stats->dump(STDOUT_FILENO);
+    gps->cleanup();
+
+    if (config.trace != NULL)
+        printf("%s replayed in %.1f s\n", config.trace, elapsed / 1e9);
+    else
+        printf("%u epochs in %d s at %d/s, %d NMEA sentences each\n", synthetic_gps_epochs(),
+               seconds, config.rate, config.nmea_per_epoch);
+    channel_report(&locations, synthetic_gps_count(SYNTHETIC_LOCATION));
+    channel_report(&svStatus, synthetic_gps_count(SYNTHETIC_SV_STATUS));
+    channel_report(&nmea, synthetic_gps_count(SYNTHETIC_NMEA));
+    printf("status reports %u, aux events %u of %u\n", statusReports, auxDelivered,
+           synthetic_gps_aux_events());
+    printf("wakelock acquired %d times, %s at exit\n", wakelockAcquired,
+           wakelockHeld ? "still held" : "released");
+    if (batching != NULL) {
+        printf("batching switched %d times\n", toggles);
+        if (locations.reordered) {
+            printf("FAIL: fixes reordered across batching changes\n");
+            return 1;
+        }
+    }
+    return 0;
+}
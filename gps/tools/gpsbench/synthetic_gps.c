@@ -0,0 +1,516 @@
+/******************************************************************************
+ * GPS HAL shim - synthetic legacy GPS library
+ *
+ * Copyright (C) 2012, rondoval
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ ******************************************************************************/
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <gpsshim.h>
+#include "synthetic_gps.h"
+#include "trace.h"
+
+static SyntheticGpsConfig config = { 1, 4, 0, NULL, 1 };
+
+static OldGpsCallbacks *callbacks = NULL;
+static OldAGpsCallbacks *agpsCallbacks = NULL;
+static OldGpsXtraCallbacks *xtraCallbacks = NULL;
+static OldAGpsRilCallbacks *rilCallbacks = NULL;
+static GpsNiCallbacks *niCallbacks = NULL;
+
+static pthread_t coreThread, auxThread;
+static volatile int running = 0;    /* threads alive, between init and cleanup */
+static volatile int started = 0;    /* engine on, between start and stop */
+static volatile uint32_t epochs = 0;
+static volatile uint32_t auxEvents = 0;
+static int64_t sendLog[SYNTHETIC_SEND_LOG];
+
+/* Replay state */
+static char *traceData = NULL;
+static size_t traceLength = 0;
+static volatile int replayDone = 0;
+static uint32_t replayCounts[SYNTHETIC_CHANNELS];
+static uint32_t replaySkipped = 0;
+static struct {
+    volatile uint32_t key;
+    int64_t sent;
+} replayLog[SYNTHETIC_CHANNELS][SYNTHETIC_SEND_LOG];
+
+static const char *sentenceIds[] = {
+    "GPGGA", "GPGSA", "GPGSV", "GPGSV", "GPGSV", "GPRMC", "GPVTG", "GPGLL",
+};
+
+int64_t synthetic_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int load_trace(const char *path) {
+    const TraceFileHeader *header;
+    FILE *file = fopen(path, "rb");
+    long length;
+
+    if (file == NULL) {
+        perror(path);
+        return -1;
+    }
+    fseek(file, 0, SEEK_END);
+    length = ftell(file);
+    rewind(file);
+    traceData = malloc(length > 0 ? length : 1);
+    if (traceData == NULL || length < (long)sizeof(*header) ||
+            fread(traceData, 1, length, file) != (size_t)length) {
+        fprintf(stderr, "%s: could not read trace\n", path);
+        fclose(file);
+        return -1;
+    }
+    fclose(file);
+
+    header = (const TraceFileHeader *)traceData;
+    if (header->magic != SHIM_TRACE_MAGIC || header->version != SHIM_TRACE_VERSION) {
+        fprintf(stderr, "%s: not a version %d shim trace\n", path, SHIM_TRACE_VERSION);
+        return -1;
+    }
+    traceLength = length;
+    return 0;
+}
+
+int synthetic_gps_configure(const SyntheticGpsConfig *c) {
+    config = *c;
+    if (config.rate < 1)
+        config.rate = 1;
+    if (config.nmea_per_epoch > 8)
+        config.nmea_per_epoch = 8;
+    if (config.trace != NULL)
+        return load_trace(config.trace);
+    return 0;
+}
+
+int64_t synthetic_gps_sent(int channel, uint32_t key) {
+    uint32_t slot = key & (SYNTHETIC_SEND_LOG - 1);
+    int64_t sent;
+
+    if (config.trace == NULL) {
+        if (epochs - key > SYNTHETIC_SEND_LOG)
+            return 0;
+        return sendLog[slot];
+    }
+    sent = replayLog[channel][slot].sent;
+    __sync_synchronize();
+    return replayLog[channel][slot].key == key ? sent : 0;
+}
+
+uint32_t synthetic_gps_count(int channel) {
+    if (config.trace != NULL)
+        return replayCounts[channel];
+    return channel == SYNTHETIC_NMEA ? epochs * config.nmea_per_epoch : epochs;
+}
+
+int synthetic_gps_done() {
+    return replayDone;
+}
+
+uint32_t synthetic_gps_epochs() {
+    return epochs;
+}
+
+uint32_t synthetic_gps_aux_events() {
+    return auxEvents;
+}
+
+/* Sleep until the absolute monotonic time deadline (ns) */
+static void sleep_until(int64_t deadline) {
+    struct timespec ts;
+
+    ts.tv_sec = deadline / 1000000000LL;
+    ts.tv_nsec = deadline % 1000000000LL;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL))
+        ;
+}
+
+static void emit_epoch(uint32_t epoch) {
+    OldGpsLocation location;
+    OldGpsSvStatus sv;
+    char sentence[128];
+    unsigned char sum;
+    int i, length;
+
+    /* A receiver slowly moving north, with a satellite view that keeps changing */
+    memset(&sv, 0, sizeof(sv));
+    sv.num_svs = 8;
+    for (i = 0; i < sv.num_svs; i++) {
+        sv.sv_list[i].prn = i + 1;
+        sv.sv_list[i].snr = 20 + (epoch + i) % 4 * 5;
+        sv.sv_list[i].elevation = 10 * i;
+        sv.sv_list[i].azimuth = 40 * i;
+    }
+    sv.used_in_fix_mask = 0x3f;
+    sv.almanac_mask = epoch;
+    callbacks->sv_status_cb(&sv);
+
+    for (i = 0; i < config.nmea_per_epoch; i++) {
+        length = snprintf(sentence, sizeof(sentence) - 6,
+                          "$%s,%06u.00,4807.038,N,01131.000,E,1,08,0.9,545.4,M,46.9,M,,",
+                          sentenceIds[i], epoch % 240000);
+        for (sum = 0, length = 1; sentence[length]; length++)
+            sum ^= sentence[length];
+        length += sprintf(sentence + length, "*%02X\r\n", sum);
+        callbacks->nmea_cb(epoch, sentence, length);
+    }
+
+    memset(&location, 0, sizeof(location));
+    location.flags = GPS_LOCATION_HAS_LAT_LONG | GPS_LOCATION_HAS_ALTITUDE |
+                     GPS_LOCATION_HAS_SPEED | GPS_LOCATION_HAS_ACCURACY;
+    location.latitude = 48.1 + epoch * 1e-5;
+    location.longitude = 11.5;
+    location.altitude = 545;
+    location.speed = 1;
+    location.accuracy = 5;
+    location.timestamp = epoch;
+    callbacks->location_cb(&location);
+}
+
+/* Remember the send time of the first event with this key */
+static void replay_sent(int channel, uint32_t key) {
+    uint32_t slot = key & (SYNTHETIC_SEND_LOG - 1);
+
+    if (replayCounts[channel]++ && replayLog[channel][slot].key == key)
+        return;
+    replayLog[channel][slot].key = ~key;
+    __sync_synchronize();
+    replayLog[channel][slot].sent = synthetic_now_ns();
+    __sync_synchronize();
+    replayLog[channel][slot].key = key;
+}
+
+/*
+ * Payloads are the device's own structures; a host whose layout differs
+ * (doubles are only 4 byte aligned on 32 bit x86) skips them.
+ */
+static void replay_record(const TraceRecord *record, const char *payload) {
+    OldGpsLocation location;
+    OldGpsStatus status;
+    OldGpsSvStatus sv;
+    TraceSvStatus traceSv;
+    OldAGpsStatus agpsStatus;
+    GpsNiNotification notification;
+    GpsUtcTime timestamp;
+    char sentence[1024];
+    uint32_t flags;
+    int length;
+
+    switch (record->type) {
+    case TRACE_LOCATION:
+        if (record->length != sizeof(location))
+            break;
+        memcpy(&location, payload, sizeof(location));
+        replay_sent(SYNTHETIC_LOCATION, location.timestamp);
+        callbacks->location_cb(&location);
+        return;
+    case TRACE_STATUS:
+        if (record->length != sizeof(status))
+            break;
+        memcpy(&status, payload, sizeof(status));
+        callbacks->status_cb(&status);
+        return;
+    case TRACE_SV_STATUS:
+        if (record->length < sizeof(traceSv))
+            break;
+        memcpy(&traceSv, payload, sizeof(traceSv));
+        if (traceSv.num_svs < 0 || traceSv.num_svs > GPS_MAX_SVS ||
+                record->length != sizeof(traceSv) + traceSv.num_svs * sizeof(OldGpsSvInfo))
+            break;
+        memset(&sv, 0, sizeof(sv));
+        sv.num_svs = traceSv.num_svs;
+        memcpy(sv.sv_list, payload + sizeof(traceSv), sv.num_svs * sizeof(OldGpsSvInfo));
+        sv.ephemeris_mask = traceSv.ephemeris_mask;
+        sv.almanac_mask = traceSv.almanac_mask;
+        sv.used_in_fix_mask = traceSv.used_in_fix_mask;
+        replayCounts[SYNTHETIC_SV_STATUS]++;
+        callbacks->sv_status_cb(&sv);
+        return;
+    case TRACE_NMEA:
+        length = record->length - sizeof(timestamp);
+        if (length <= 0 || length >= (int)sizeof(sentence))
+            break;
+        memcpy(&timestamp, payload, sizeof(timestamp));
+        memcpy(sentence, payload + sizeof(timestamp), length);
+        sentence[length] = '\0';
+        replay_sent(SYNTHETIC_NMEA, timestamp);
+        callbacks->nmea_cb(timestamp, sentence, length);
+        return;
+    case TRACE_AGPS_STATUS:
+        if (record->length != sizeof(agpsStatus) || agpsCallbacks == NULL)
+            break;
+        memcpy(&agpsStatus, payload, sizeof(agpsStatus));
+        auxEvents++;
+        agpsCallbacks->status_cb(&agpsStatus);
+        return;
+    case TRACE_AGPSRIL_SETID:
+    case TRACE_AGPSRIL_REFLOC:
+        if (record->length != sizeof(flags) || rilCallbacks == NULL)
+            break;
+        memcpy(&flags, payload, sizeof(flags));
+        auxEvents++;
+        if (record->type == TRACE_AGPSRIL_SETID)
+            rilCallbacks->request_setid(flags);
+        else
+            rilCallbacks->request_refloc(flags);
+        return;
+    case TRACE_XTRA_DOWNLOAD:
+        if (xtraCallbacks == NULL)
+            break;
+        auxEvents++;
+        xtraCallbacks->download_request_cb();
+        return;
+    case TRACE_NI_NOTIFY:
+        if (record->length != sizeof(notification) || niCallbacks == NULL)
+            break;
+        memcpy(&notification, payload, sizeof(notification));
+        auxEvents++;
+        niCallbacks->notify_cb(&notification);
+        return;
+    }
+    replaySkipped++;
+}
+
+static void replay_trace() {
+    const char *p = traceData + sizeof(TraceFileHeader), *end = traceData + traceLength;
+    int64_t start = synthetic_now_ns(), offset = 0;
+    TraceRecord record;
+
+    while (running && end - p >= (long)sizeof(record)) {
+        memcpy(&record, p, sizeof(record));
+        p += sizeof(record);
+        if (end - p < record.length)
+            break;
+        offset += record.delta_us * 1000LL;
+        if (config.speed > 0)
+            sleep_until(start + (int64_t)(offset / config.speed));
+        replay_record(&record, p);
+        p += record.length;
+    }
+    if (replaySkipped)
+        fprintf(stderr, "replay: skipped %u records that do not match this host\n",
+                replaySkipped);
+    replayDone = 1;
+}
+
+static void* core_loop(void *unused) {
+    int64_t period, next = synthetic_now_ns();
+    uint32_t epoch;
+
+    if (config.trace != NULL) {
+        while (running && !started)
+            usleep(1000);
+        replay_trace();
+        return NULL;
+    }
+
+    while (running) {
+        period = 1000000000LL / config.rate;
+        next += period;
+        if (started) {
+            epoch = epochs;
+            sendLog[epoch & (SYNTHETIC_SEND_LOG - 1)] = synthetic_now_ns();
+            __sync_synchronize();
+            epochs = epoch + 1;
+            emit_epoch(epoch);
+        }
+        sleep_until(next);
+    }
+    return NULL;
+}
+
+static void* aux_loop(void *unused) {
+    OldAGpsStatus status;
+    GpsNiNotification notification;
+    int64_t next = synthetic_now_ns();
+
+    while (running && config.aux_rate > 0 && config.trace == NULL) {
+        next += 1000000000LL / config.aux_rate;
+        if (started && agpsCallbacks) {
+            status.type = AGPS_TYPE_SUPL;
+            status.status = auxEvents & 1 ? GPS_RELEASE_AGPS_DATA_CONN : GPS_REQUEST_AGPS_DATA_CONN;
+            agpsCallbacks->status_cb(&status);
+            auxEvents++;
+        }
+        if (started && xtraCallbacks) {
+            xtraCallbacks->download_request_cb();
+            auxEvents++;
+        }
+        if (started && niCallbacks) {
+            memset(&notification, 0, sizeof(notification));
+            notification.size = sizeof(notification);
+            notification.notification_id = auxEvents;
+            notification.ni_type = GPS_NI_TYPE_UMTS_SUPL;
+            notification.timeout = 8;
+            notification.default_response = GPS_NI_RESPONSE_ACCEPT;
+            strcpy(notification.requestor_id, "gpsbench");
+            niCallbacks->notify_cb(&notification);
+            auxEvents++;
+        }
+        sleep_until(next);
+    }
+    return NULL;
+}
+
+static int synthetic_init(OldGpsCallbacks *cb) {
+    callbacks = cb;
+    running = 1;
+    pthread_create(&coreThread, NULL, core_loop, NULL);
+    pthread_create(&auxThread, NULL, aux_loop, NULL);
+    return 0;
+}
+
+static int synthetic_start() {
+    started = 1;
+    return 0;
+}
+
+static int synthetic_stop() {
+    started = 0;
+    return 0;
+}
+
+static void synthetic_cleanup() {
+    running = 0;
+    pthread_join(coreThread, NULL);
+    pthread_join(auxThread, NULL);
+}
+
+static int synthetic_inject_time(GpsUtcTime time, int64_t timeReference, int uncertainty) {
+    return 0;
+}
+
+static int synthetic_inject_location(double latitude, double longitude, float accuracy) {
+    return 0;
+}
+
+static void synthetic_delete_aiding_data(GpsAidingData flags) {
+}
+
+static int synthetic_set_position_mode(GpsPositionMode mode, int fix_frequency) {
+    return 0;
+}
+
+static void synthetic_agps_init(OldAGpsCallbacks *cb) {
+    agpsCallbacks = cb;
+}
+
+static int synthetic_agps_data_conn_open(const char *apn) {
+    return 0;
+}
+
+static int synthetic_agps_data_conn_closed() {
+    return 0;
+}
+
+static int synthetic_agps_data_conn_failed() {
+    return 0;
+}
+
+static int synthetic_agps_set_server(AGpsType type, const char *hostname, int port) {
+    return 0;
+}
+
+static int synthetic_xtra_init(OldGpsXtraCallbacks *cb) {
+    xtraCallbacks = cb;
+    return 0;
+}
+
+static int synthetic_xtra_inject(char *data, int length) {
+    return 0;
+}
+
+static void synthetic_agpsril_init(OldAGpsRilCallbacks *cb) {
+    rilCallbacks = cb;
+}
+
+static void synthetic_agpsril_set_ref_location(const AGpsRefLocation *location, size_t size) {
+}
+
+static void synthetic_agpsril_set_set_id(AGpsSetIDType type, const char *setid) {
+}
+
+static void synthetic_agpsril_ni_message(uint8_t *msg, size_t length) {
+}
+
+static const OldAGpsInterface synthetic_agps = {
+    synthetic_agps_init,
+    synthetic_agps_data_conn_open,
+    synthetic_agps_data_conn_closed,
+    synthetic_agps_data_conn_failed,
+    synthetic_agps_set_server,
+};
+
+static void synthetic_ni_init(GpsNiCallbacks *cb) {
+    niCallbacks = cb;
+}
+
+static void synthetic_ni_respond(int id, GpsUserResponseType response) {
+}
+
+static const OldGpsNiInterface synthetic_ni = {
+    synthetic_ni_init,
+    synthetic_ni_respond,
+};
+
+static const OldGpsXtraInterface synthetic_xtra = {
+    synthetic_xtra_init,
+    synthetic_xtra_inject,
+};
+
+static const OldAGpsRilInterface synthetic_agpsril = {
+    synthetic_agpsril_init,
+    synthetic_agpsril_set_ref_location,
+    synthetic_agpsril_set_set_id,
+    synthetic_agpsril_ni_message,
+};
+
+static const void* synthetic_get_extension(const char *name) {
+    if (!strcmp(name, AGPS_INTERFACE))
+        return &synthetic_agps;
+    if (!strcmp(name, GPS_XTRA_INTERFACE))
+        return &synthetic_xtra;
+    if (!strcmp(name, AGPS_RIL_INTERFACE))
+        return &synthetic_agpsril;
+    if (!strcmp(name, GPS_NI_INTERFACE))
+        return &synthetic_ni;
+    return NULL;
+}
+
+static const OldGpsInterface synthetic_interface = {
+    synthetic_init,
+    synthetic_start,
+    synthetic_stop,
+    synthetic_cleanup,
+    synthetic_inject_time,
+    synthetic_inject_location,
+    synthetic_delete_aiding_data,
+    synthetic_set_position_mode,
+    synthetic_get_extension,
+};
+
+const OldGpsInterface* gps_get_hardware_interface() {
+    return &synthetic_interface;
+}
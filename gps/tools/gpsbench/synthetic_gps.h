@@ -0,0 +1,69 @@
+/******************************************************************************
+ * GPS HAL shim - synthetic legacy GPS library
+ *
+ * Copyright (C) 2012, rondoval
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ ******************************************************************************/
+
+#ifndef GPSSHIM_SYNTHETIC_GPS_H
+#define GPSSHIM_SYNTHETIC_GPS_H
+
+#include <stdint.h>
+
+/*
+ * Stand-in for a vendor libgps: implements gps_get_hardware_interface() and
+ * emits synthetic callbacks from its own threads while started. Every core
+ * event carries the number of its epoch (fix timestamp, NMEA timestamp and
+ * SV almanac mask) so that a sink can match it with its send time.
+ *
+ * With a trace set, the callbacks recorded by the shim (persist.gpsshim.trace)
+ * are replayed instead, from the first start on, with their original spacing
+ * divided by speed. Locations and NMEA are then keyed by their own timestamps;
+ * SV status has no usable key and reports no latency.
+ */
+typedef struct {
+    int     rate;               /* epochs per second, 1..10000 */
+    int     nmea_per_epoch;     /* sentences per epoch, at most 8 */
+    int     aux_rate;           /* AGPS status, XTRA and NI requests per second, 0 for none */
+    const char *trace;          /* trace file to replay, NULL for synthetic epochs */
+    double  speed;              /* replay speed, 0 for as fast as possible */
+} SyntheticGpsConfig;
+
+enum {
+    SYNTHETIC_LOCATION,
+    SYNTHETIC_SV_STATUS,
+    SYNTHETIC_NMEA,
+    SYNTHETIC_CHANNELS,
+};
+
+#define SYNTHETIC_SEND_LOG  (1 << 16)   /* keys whose send time is remembered */
+
+/* Call before the shim initializes the legacy interface. Returns 0 on success. */
+int synthetic_gps_configure(const SyntheticGpsConfig *config);
+
+/* Monotonic send time of an event, in nanoseconds, or 0 if unknown */
+int64_t synthetic_gps_sent(int channel, uint32_t key);
+
+/* Events emitted so far on a channel, epochs and aux events */
+uint32_t synthetic_gps_count(int channel);
+uint32_t synthetic_gps_epochs();
+uint32_t synthetic_gps_aux_events();
+
+/* Non-zero once the whole trace has been replayed */
+int synthetic_gps_done();
+
+int64_t synthetic_now_ns();
+
+#endif
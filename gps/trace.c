@@ -0,0 +1,191 @@
+/******************************************************************************
+ * GPS HAL shim - legacy callback traces
+ *
+ * Copyright (C) 2012, rondoval
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ ******************************************************************************/
+
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#define LOG_TAG "gps-shim"
+#include <utils/Log.h>
+#include <cutils/atomic.h>
+
+#include "persist.h"
+#include "trace.h"
+
+/*
+ * Records are appended to a byte ring under traceLock, which only covers a
+ * memcpy. A background thread writes the ring out in large chunks, once it
+ * is a quarter full or at least every second, so tracing costs neither
+ * blocking I/O on the callback threads nor a write per callback.
+ */
+#define TRACE_BUFFER_SIZE   (256 * 1024)    /* power of two */
+#define TRACE_FLUSH_SIZE    (TRACE_BUFFER_SIZE / 4)
+
+static pthread_mutex_t traceLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t traceCond = PTHREAD_COND_INITIALIZER;
+static pthread_t traceWriter;
+static volatile int32_t traceActive = 0;
+static int traceQuit = 0;
+static int traceFd = -1;
+static char *traceBuffer = NULL;
+static uint32_t traceHead = 0;          /* bytes appended, guarded by traceLock */
+static uint32_t traceTail = 0;          /* bytes written out, guarded by traceLock */
+static int64_t traceLast = 0;           /* ns, time of the previous record */
+static uint32_t traceRecords = 0;
+static uint32_t traceDropped = 0;
+
+static int64_t trace_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* traceLock held */
+static void trace_put(const void *data, size_t length) {
+    uint32_t offset = traceHead & (TRACE_BUFFER_SIZE - 1);
+    size_t first = TRACE_BUFFER_SIZE - offset;
+
+    if (first > length)
+        first = length;
+    memcpy(traceBuffer + offset, data, first);
+    memcpy(traceBuffer, (const char *)data + first, length - first);
+    traceHead += length;
+}
+
+void trace_record(int type, const void *a, size_t a_length, const void *b, size_t b_length) {
+    TraceRecord record;
+    size_t length = sizeof(record) + a_length + b_length;
+    int64_t now;
+
+    if (!android_atomic_acquire_load(&traceActive))
+        return;
+
+    pthread_mutex_lock(&traceLock);
+    if (!traceActive || a_length + b_length > UINT16_MAX ||
+            TRACE_BUFFER_SIZE - (traceHead - traceTail) < length) {
+        if (traceActive)
+            traceDropped++;
+        pthread_mutex_unlock(&traceLock);
+        return;
+    }
+    now = trace_now_ns();
+    record.type = type;
+    record.reserved = 0;
+    record.length = a_length + b_length;
+    record.padding = 0;
+    record.delta_us = (now - traceLast) / 1000;
+    traceLast = now;
+    trace_put(&record, sizeof(record));
+    trace_put(a, a_length);
+    trace_put(b, b_length);
+    traceRecords++;
+    if (traceHead - traceTail >= TRACE_FLUSH_SIZE)
+        pthread_cond_signal(&traceCond);
+    pthread_mutex_unlock(&traceLock);
+}
+
+static void* trace_writer(void *unused) {
+    struct timespec deadline;
+    uint32_t head, tail, offset, first;
+
+    pthread_mutex_lock(&traceLock);
+    while (!traceQuit || traceHead != traceTail) {
+        if (!traceQuit && traceHead - traceTail < TRACE_FLUSH_SIZE) {
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec++;
+            if (pthread_cond_timedwait(&traceCond, &traceLock, &deadline) != ETIMEDOUT)
+                continue;
+        }
+        head = traceHead;
+        tail = traceTail;
+        if (head == tail)
+            continue;
+
+        /* Producers never touch [tail, head), so write it without the lock */
+        pthread_mutex_unlock(&traceLock);
+        offset = tail & (TRACE_BUFFER_SIZE - 1);
+        first = TRACE_BUFFER_SIZE - offset;
+        if (first > head - tail)
+            first = head - tail;
+        if (write_fully(traceFd, traceBuffer + offset, first) ||
+                write_fully(traceFd, traceBuffer, head - tail - first))
+            LOGW("Trace write failed: %s", strerror(errno));
+        pthread_mutex_lock(&traceLock);
+        traceTail = head;
+    }
+    pthread_mutex_unlock(&traceLock);
+    return NULL;
+}
+
+int trace_start(const char *dir) {
+    TraceFileHeader header;
+    char path[256];
+
+    if (traceFd >= 0)
+        return 0;
+    snprintf(path, sizeof(path), "%s/gpsshim-%ld.trace", dir, (long)time(NULL));
+    traceFd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (traceFd < 0) {
+        LOGW("Could not create trace %s: %s", path, strerror(errno));
+        return -1;
+    }
+    header.magic = SHIM_TRACE_MAGIC;
+    header.version = SHIM_TRACE_VERSION;
+    header.wall_time = wall_time_ms();
+    traceBuffer = malloc(TRACE_BUFFER_SIZE);
+    if (traceBuffer == NULL || write_fully(traceFd, &header, sizeof(header))) {
+        LOGW("Could not start trace %s", path);
+        free(traceBuffer);
+        traceBuffer = NULL;
+        close(traceFd);
+        traceFd = -1;
+        return -1;
+    }
+
+    traceHead = traceTail = 0;
+    traceRecords = traceDropped = 0;
+    traceQuit = 0;
+    traceLast = trace_now_ns();
+    pthread_create(&traceWriter, NULL, trace_writer, NULL);
+    android_atomic_release_store(1, &traceActive);
+    LOGI("Tracing legacy callbacks to %s", path);
+    return 0;
+}
+
+void trace_stop() {
+    if (traceFd < 0)
+        return;
+    pthread_mutex_lock(&traceLock);
+    android_atomic_release_store(0, &traceActive);
+    traceQuit = 1;
+    pthread_cond_signal(&traceCond);
+    pthread_mutex_unlock(&traceLock);
+    pthread_join(traceWriter, NULL);
+
+    close(traceFd);
+    traceFd = -1;
+    free(traceBuffer);
+    traceBuffer = NULL;
+    LOGI("Trace closed: %u records, %u dropped", traceRecords, traceDropped);
+}
@@ -0,0 +1,83 @@
+/******************************************************************************
+ * GPS HAL shim - legacy callback traces
+ *
+ * Copyright (C) 2012, rondoval
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ ******************************************************************************/
+
+
+#ifndef GPSSHIM_TRACE_H
+#define GPSSHIM_TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Trace file layout: a TraceFileHeader, then one TraceRecord header per
+ * legacy callback followed by its payload. Payloads are the legacy
+ * structures exactly as the library passed them, except SV status which
+ * only keeps the satellites actually reported.
+ */
+#define SHIM_TRACE_MAGIC    0x45435254      /* "TRCE" */
+#define SHIM_TRACE_VERSION  2
+
+enum {
+    TRACE_LOCATION = 1,     /* OldGpsLocation */
+    TRACE_STATUS,           /* OldGpsStatus */
+    TRACE_SV_STATUS,        /* TraceSvStatus, then num_svs OldGpsSvInfo */
+    TRACE_NMEA,             /* GpsUtcTime timestamp, then the sentence */
+    TRACE_AGPS_STATUS,      /* OldAGpsStatus */
+    TRACE_AGPSRIL_SETID,    /* uint32_t flags */
+    TRACE_AGPSRIL_REFLOC,   /* uint32_t flags */
+    TRACE_XTRA_DOWNLOAD,    /* no payload */
+    TRACE_NI_NOTIFY,        /* GpsNiNotification */
+};
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    int64_t  wall_time;     /* ms since the epoch when tracing started */
+} TraceFileHeader;
+
+typedef struct {
+    uint8_t  type;
+    uint8_t  reserved;
+    uint16_t length;        /* payload bytes */
+    uint32_t padding;       /* zero */
+    uint64_t delta_us;      /* monotonic time since the previous record, idle gaps included */
+} TraceRecord;
+
+typedef struct {
+    int32_t  num_svs;
+    uint32_t ephemeris_mask;
+    uint32_t almanac_mask;
+    uint32_t used_in_fix_mask;
+} TraceSvStatus;
+
+/* Start writing a new trace file in dir. Returns 0 on success. */
+int trace_start(const char *dir);
+
+/* Flush what is buffered and close the trace */
+void trace_stop();
+
+/*
+ * Append one record made of two payload parts (either may be empty). Safe
+ * to call from any thread; a no-op unless tracing. Never blocks on I/O:
+ * records that do not fit in the buffer, or whose payload is longer than
+ * a TraceRecord can describe, are dropped and counted.
+ */
+void trace_record(int type, const void *a, size_t a_length, const void *b, size_t b_length);
+
+#endif
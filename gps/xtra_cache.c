@@ -0,0 +1,119 @@
+/******************************************************************************
+ * GPS HAL shim - XTRA assistance data cache
+ *
+ * Copyright (C) 2012, rondoval
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ ******************************************************************************/
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#define LOG_TAG "gps-shim"
+#include <utils/Log.h>
+
+#include "persist.h"
+#include "xtra_cache.h"
+
+#define XTRA_CACHE_MAGIC    0x41525458      /* "XTRA" */
+#define XTRA_CACHE_VERSION  1
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    int64_t  stored;        /* wall clock seconds */
+    uint32_t length;        /* payload bytes following the header */
+    uint32_t checksum;      /* of the payload */
+} XtraCacheHeader;
+
+static uint32_t xtra_checksum(const char *data, int length) {
+    uint32_t sum = 0;
+    int i;
+
+    /* Cheap rotate-and-add, only meant to catch a torn or clobbered file */
+    for (i = 0; i < length; i++)
+        sum = ((sum << 5) | (sum >> 27)) + (unsigned char)data[i];
+    return sum;
+}
+
+int xtra_cache_store(const char *path, const char *data, int length) {
+    XtraCacheHeader header;
+
+    if (length <= 0)
+        return -1;
+    header.magic = XTRA_CACHE_MAGIC;
+    header.version = XTRA_CACHE_VERSION;
+    header.stored = time(NULL);
+    header.length = length;
+    header.checksum = xtra_checksum(data, length);
+    return persist_replace(path, &header, sizeof(header), data, length);
+}
+
+int xtra_cache_map(const char *path, time_t max_age, XtraCacheMapping *mapping) {
+    const XtraCacheHeader *header;
+    struct stat st;
+    time_t now = time(NULL);
+    int fd;
+
+    memset(mapping, 0, sizeof(*mapping));
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    if (fstat(fd, &st) || st.st_size <= (off_t)sizeof(XtraCacheHeader)) {
+        close(fd);
+        return -1;
+    }
+
+    /* MAP_PRIVATE: inject_xtra_data() takes a char *, writes stay private */
+    mapping->base = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping->base == MAP_FAILED) {
+        mapping->base = NULL;
+        return -1;
+    }
+    mapping->size = st.st_size;
+
+    header = mapping->base;
+    if (header->magic != XTRA_CACHE_MAGIC || header->version != XTRA_CACHE_VERSION ||
+            header->length != st.st_size - sizeof(XtraCacheHeader)) {
+        LOGW("Ignoring corrupt XTRA cache %s", path);
+        xtra_cache_unmap(mapping);
+        return -1;
+    }
+    /* A clock that went backwards (no network time yet) makes the cache useless too */
+    if (now < header->stored || now - header->stored >= max_age) {
+        LOGV("XTRA cache is stale (stored %lld, now %ld)", (long long)header->stored, (long)now);
+        xtra_cache_unmap(mapping);
+        return -1;
+    }
+
+    mapping->data = (char *)mapping->base + sizeof(XtraCacheHeader);
+    mapping->length = header->length;
+    mapping->age = now - header->stored;
+    if (xtra_checksum(mapping->data, mapping->length) != header->checksum) {
+        LOGW("Ignoring corrupt XTRA cache %s", path);
+        xtra_cache_unmap(mapping);
+        return -1;
+    }
+    return 0;
+}
+
+void xtra_cache_unmap(XtraCacheMapping *mapping) {
+    if (mapping->base)
+        munmap(mapping->base, mapping->size);
+    memset(mapping, 0, sizeof(*mapping));
+}
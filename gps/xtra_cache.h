@@ -0,0 +1,52 @@
+/******************************************************************************
+ * GPS HAL shim - XTRA assistance data cache
+ *
+ * Copyright (C) 2012, rondoval
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ ******************************************************************************/
+
+#ifndef GPSSHIM_XTRA_CACHE_H
+#define GPSSHIM_XTRA_CACHE_H
+
+#include <stddef.h>
+#include <time.h>
+
+#define XTRA_CACHE_PATH     "/data/system/gpsshim-xtra.bin"
+
+typedef struct {
+    void   *base;       /* whole file mapping, for xtra_cache_unmap() */
+    size_t  size;
+    char   *data;       /* XTRA payload inside the mapping */
+    int     length;
+    time_t  age;        /* seconds since the data was stored */
+} XtraCacheMapping;
+
+/*
+ * Save data as the current cache contents. The file is replaced atomically,
+ * so a crash never leaves a truncated cache behind. Returns 0 on success.
+ */
+int xtra_cache_store(const char *path, const char *data, int length);
+
+/*
+ * Map the cached data if it was stored less than max_age seconds ago. The
+ * mapping is private and writable, so it can be handed to inject_xtra_data()
+ * as is: pages are read straight from the page cache and never copied to the
+ * heap. Returns 0 on success, -1 if the cache is missing, corrupt or stale.
+ */
+int xtra_cache_map(const char *path, time_t max_age, XtraCacheMapping *mapping);
+
+void xtra_cache_unmap(XtraCacheMapping *mapping);
+
+#endif